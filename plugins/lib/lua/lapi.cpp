@@ -1079,7 +1079,7 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
         luaC_checkGC(L);
       }
       g->gcrunning = oldrunning;  /* restore previous state */
-      if (debt > 0 && g->gcstate == GCSpause)  /* end of cycle? */
+      if (debt > 0 && (g->gcstate == GCSpause || g->gckind == KGC_GEN))
         res = 1;  /* signal it */
       break;
     }
@@ -1098,6 +1098,17 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCGEN: {
+      res = (g->gckind == KGC_GEN) ? LUA_GCGEN : LUA_GCINC;
+      if (data > 0) g->genminormul = data;
+      luaC_changemode(L, KGC_GEN);
+      break;
+    }
+    case LUA_GCINC: {
+      res = (g->gckind == KGC_GEN) ? LUA_GCGEN : LUA_GCINC;
+      luaC_changemode(L, KGC_NORMAL);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
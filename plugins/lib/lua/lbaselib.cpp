@@ -173,10 +173,10 @@ static int luaB_rawset (lua_State *L) {
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "generational", "incremental", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   int ex = (int)luaL_optinteger(L, 2, 0);
   int res = lua_gc(L, o, ex);
@@ -190,6 +190,10 @@ static int luaB_collectgarbage (lua_State *L) {
       lua_pushboolean(L, res);
       return 1;
     }
+    case LUA_GCGEN: case LUA_GCINC: {
+      lua_pushstring(L, (res == LUA_GCGEN) ? "generational" : "incremental");
+      return 1;
+    }
     default: {
       lua_pushinteger(L, res);
       return 1;
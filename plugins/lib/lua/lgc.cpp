@@ -378,6 +378,8 @@ static void traverseweakvalue (global_State *g, Table *h) {
     linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
   else if (hasclears)
     linkgclist(h, g->weak);  /* has to be cleared later */
+  else if (g->gckind == KGC_GEN)  /* keep it gray for next minor cycle */
+    linkgclist(h, g->grayagain);
 }
 
 
@@ -426,6 +428,8 @@ static int traverseephemeron (global_State *g, Table *h) {
     linkgclist(h, g->ephemeron);  /* have to propagate again */
   else if (hasclears)  /* table has white keys? */
     linkgclist(h, g->allweak);  /* may have to clean white keys */
+  else if (g->gckind == KGC_GEN)  /* keep it gray for next minor cycle */
+    linkgclist(h, g->grayagain);
   return marked;
 }
 
@@ -729,13 +733,15 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count);
 ** sweep at most 'count' elements from a list of GCObjects erasing dead
 ** objects, where a dead object is one marked with the old (non current)
 ** white; change all non-dead objects back to white, preparing for next
-** collection cycle. Return where to continue the traversal or NULL if
+** collection cycle. In generational mode, marks are kept, so surviving
+** objects become old. Return where to continue the traversal or NULL if
 ** list is finished.
 */
 static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
   global_State *g = G(L);
   int ow = otherwhite(g);
   int white = luaC_white(g);  /* current white */
+  int keepmarks = (g->gckind == KGC_GEN);
   while (*p != NULL && count-- > 0) {
     GCObject *curr = *p;
     int marked = curr->marked;
@@ -744,7 +750,8 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
       freeobj(L, curr);  /* erase 'curr' */
     }
     else {  /* change mark to 'white' */
-      curr->marked = cast_byte((marked & maskcolors) | white);
+      if (!keepmarks)
+        curr->marked = cast_byte((marked & maskcolors) | white);
       p = &curr->next;  /* go to next element */
     }
   }
@@ -984,6 +991,7 @@ static l_mem atomic (lua_State *L) {
   l_mem work;
   GCObject *origweak, *origall;
   GCObject *grayagain = g->grayagain;  /* save original list */
+  g->grayagain = NULL;
   lua_assert(g->ephemeron == NULL && g->weak == NULL);
   lua_assert(!iswhite(g->mainthread));
   g->gcstate = GCSinsideatomic;
@@ -1021,6 +1029,7 @@ static l_mem atomic (lua_State *L) {
   clearvalues(g, g->allweak, origall);
   luaS_clearcache(g);
   g->currentwhite = cast_byte(otherwhite(g));  /* flip current white */
+  g->gccycles++;
   work += g->GCmemtrav;  /* complete counting */
   return work;  /* estimate of memory marked by 'atomic' */
 }
@@ -1042,7 +1051,7 @@ static lu_mem sweepstep (lua_State *L, global_State *g,
 }
 
 
-static lu_mem singlestep (lua_State *L) {
+static lu_mem gcstep (lua_State *L) {
   global_State *g = G(L);
   switch (g->gcstate) {
     case GCSpause: {
@@ -1077,7 +1086,8 @@ static lu_mem singlestep (lua_State *L) {
       return sweepstep(L, g, GCSswpend, NULL);
     }
     case GCSswpend: {  /* finish sweeps */
-      makewhite(g, g->mainthread);  /* sweep main thread */
+      if (g->gckind != KGC_GEN)
+        makewhite(g, g->mainthread);  /* sweep main thread */
       checkSizes(L, g);
       g->gcstate = GCScallfin;
       return 0;
@@ -1101,6 +1111,35 @@ static lu_mem singlestep (lua_State *L) {
 ** advances the garbage collector until it reaches a state allowed
 ** by 'statemask'
 */
+/*
+** Time accounting: when 'gcclock' is set, the time spent by the
+** collector is charged to the state it was in.
+*/
+static void starttime (global_State *g) {
+  if (g->gcclock)
+    g->gctimestamp = g->gcclock();
+}
+
+
+static void chargetime (global_State *g, int state) {
+  if (g->gcclock) {
+    l_mem now = g->gcclock();
+    g->gctime[state] += now - g->gctimestamp;
+    g->gctimestamp = now;
+  }
+}
+
+
+static lu_mem singlestep (lua_State *L) {
+  global_State *g = G(L);
+  int state = g->gcstate;
+  lu_mem work = gcstep(L);
+  if (g->gcstate != state)
+    chargetime(g, state);
+  return work;
+}
+
+
 void luaC_runtilstate (lua_State *L, int statesmask) {
   global_State *g = G(L);
   while (!testbit(statesmask, g->gcstate))
@@ -1108,6 +1147,127 @@ void luaC_runtilstate (lua_State *L, int statesmask) {
 }
 
 
+/*
+** {======================================================
+** Generational mode
+** =======================================================
+*/
+
+/*
+** Objects left in the gray lists at the end of a cycle (threads, weak
+** tables and tables caught by barriers) are not re-marked from the roots
+** in a minor collection, so they are put back in the 'gray' list to be
+** traversed again.
+*/
+static void regray (global_State *g, GCObject *l) {
+  while (l != NULL) {
+    GCObject *o = l;
+    GCObject **next;
+    switch (o->tt) {
+      case LUA_TTABLE: next = &gco2t(o)->gclist; break;
+      case LUA_TTHREAD: next = &gco2th(o)->gclist; break;
+      default: lua_assert(0); return;
+    }
+    l = *next;
+    black2gray(o);
+    *next = g->gray;
+    g->gray = o;
+  }
+}
+
+
+/*
+** Start marking for the next minor collection, keeping all marks of
+** surviving (old) objects.
+*/
+static void restartminor (global_State *g) {
+  GCObject *grayagain = g->grayagain;
+  GCObject *weak = g->weak;
+  GCObject *allweak = g->allweak;
+  GCObject *ephemeron = g->ephemeron;
+  g->grayagain = g->weak = g->allweak = g->ephemeron = NULL;
+  regray(g, grayagain);
+  regray(g, weak);
+  regray(g, allweak);
+  regray(g, ephemeron);
+  g->gcstate = GCSpropagate;
+}
+
+
+/*
+** Allow the heap to grow by 'genminormul'% of the memory in use after
+** the last major collection before the next minor collection.
+*/
+static void setminordebt (global_State *g) {
+  lu_mem base = (g->GCestimate > 0) ? g->GCestimate : gettotalbytes(g);
+  l_mem debt = cast(l_mem, (base / 100) * g->genminormul);
+  luaE_setdebt(g, -(debt > 0 ? debt : GCSTEPSIZE));
+}
+
+
+/*
+** Enter generational mode; the first minor collection after this
+** completes the marking of the whole heap.
+*/
+static void entergen (lua_State *L, global_State *g) {
+  luaC_runtilstate(L, bitmask(GCSpropagate));
+  g->gckind = KGC_GEN;
+  g->GCestimate = gettotalbytes(g);
+  setminordebt(g);
+}
+
+
+/*
+** Minor collections only mark and sweep objects created since the last
+** one (plus those caught by barriers); old objects are collected by a
+** major (full) collection, done when the heap grows more than
+** 'genmajormul'% since the last major collection. 'GCestimate' keeps
+** the memory in use after the last major collection; zero signals that
+** the next collection must be a major one.
+*/
+static void generationalcollection (lua_State *L) {
+  global_State *g = G(L);
+  lu_mem estimate = g->GCestimate;
+  if (estimate == 0)
+    luaC_fullgc(L, 0);
+  else {
+    luaC_runtilstate(L, bitmask(GCScallfin));  /* mark and sweep */
+    /* finalizers may trigger barriers on objects in the gray lists */
+    restartminor(g);
+    if (gettotalbytes(g) > (estimate / 100) * (100 + g->genmajormul))
+      g->GCestimate = 0;  /* signal for a major collection */
+    else
+      g->GCestimate = estimate;  /* keep estimate from last major */
+    setminordebt(g);
+    chargetime(g, GCScallfin);
+    while (g->tobefnz && g->gckind == KGC_GEN)
+      GCTM(L, 1);  /* call finalizers of collected objects */
+    chargetime(g, GCScallfin);
+  }
+}
+
+
+void luaC_changemode (lua_State *L, int newmode) {
+  global_State *g = G(L);
+  if (newmode == g->gckind) return;
+  starttime(g);
+  if (newmode == KGC_GEN)
+    entergen(L, g);
+  else {
+    /* sweep all objects to turn them back to white (as white has not
+       changed, nothing will be collected) */
+    g->gckind = KGC_NORMAL;
+    entersweep(L);
+    luaC_runtilstate(L, bitmask(GCScallfin) | bitmask(GCSpause));
+    g->GCestimate = gettotalbytes(g);
+    setpause(g);
+  }
+  chargetime(g, g->gcstate);
+}
+
+/* }====================================================== */
+
+
 /*
 ** get GC debt and convert it from Kb to 'work units' (avoid zero debt
 ** and overflows)
@@ -1133,6 +1293,12 @@ void luaC_step (lua_State *L) {
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  starttime(g);
+  if (g->gckind == KGC_GEN) {
+    generationalcollection(L);
+    chargetime(g, g->gcstate);
+    return;
+  }
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
@@ -1144,6 +1310,7 @@ void luaC_step (lua_State *L) {
     luaE_setdebt(g, debt);
     runafewfinalizers(L);
   }
+  chargetime(g, g->gcstate);
 }
 
 
@@ -1154,13 +1321,16 @@ void luaC_step (lua_State *L) {
 ** Before running the collection, check 'keepinvariant'; if it is true,
 ** there may be some objects marked as black, so the collector has
 ** to sweep all objects to turn them back to white (as white has not
-** changed, nothing will be collected).
+** changed, nothing will be collected). In generational mode, old objects
+** are black in any phase.
 */
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
-  lua_assert(g->gckind == KGC_NORMAL);
-  if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
-  if (keepinvariant(g)) {  /* black objects? */
+  int origkind = g->gckind;
+  lua_assert(origkind != KGC_EMERGENCY);
+  starttime(g);
+  g->gckind = isemergency ? KGC_EMERGENCY : KGC_NORMAL;
+  if (keepinvariant(g) || origkind == KGC_GEN) {  /* black objects? */
     entersweep(L); /* sweep everything to turn them back to white */
   }
   /* finish any pending sweep phase to start a new cycle */
@@ -1172,6 +1342,9 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
   g->gckind = KGC_NORMAL;
   setpause(g);
+  if (origkind == KGC_GEN)
+    entergen(L, g);
+  chargetime(g, g->gcstate);
 }
 
 /* }====================================================== */
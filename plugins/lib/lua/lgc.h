@@ -55,10 +55,12 @@
 ** ones) must be kept. During a collection, the sweep
 ** phase may break the invariant, as objects turned white may point to
 ** still-black objects. The invariant is restored when sweep ends and
-** all objects are white again.
+** all objects are white again. In generational mode, the invariant
+** must always be kept, as old objects are not whitened by sweeps.
 */
 
-#define keepinvariant(g)	((g)->gcstate <= GCSatomic)
+#define keepinvariant(g)  \
+	((g)->gckind == KGC_GEN || (g)->gcstate <= GCSatomic)
 
 
 /*
@@ -136,6 +138,7 @@ LUAI_FUNC void luaC_freeallobjects (lua_State *L);
 LUAI_FUNC void luaC_step (lua_State *L);
 LUAI_FUNC void luaC_runtilstate (lua_State *L, int statesmask);
 LUAI_FUNC void luaC_fullgc (lua_State *L, int isemergency);
+LUAI_FUNC void luaC_changemode (lua_State *L, int newmode);
 LUAI_FUNC GCObject *luaC_newobj (lua_State *L, int tt, size_t sz);
 LUAI_FUNC void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback_ (lua_State *L, Table *o);
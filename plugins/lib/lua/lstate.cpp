@@ -36,6 +36,14 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
 
+#if !defined(LUAI_GENMINORMUL)
+#define LUAI_GENMINORMUL	20  /* minor collection after 20% growth */
+#endif
+
+#if !defined(LUAI_GENMAJORMUL)
+#define LUAI_GENMAJORMUL	100  /* major collection after 100% growth */
+#endif
+
 
 /*
 ** a macro to help the creation of a unique random seed when a state is
@@ -328,6 +336,12 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->genminormul = LUAI_GENMINORMUL;
+  g->genmajormul = LUAI_GENMAJORMUL;
+  g->gccycles = 0;
+  g->gcclock = NULL;
+  g->gctimestamp = 0;
+  for (i=0; i < 8; i++) g->gctime[i] = 0;
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
@@ -71,6 +71,7 @@ struct lua_longjmp;  /* defined in ldo.c */
 /* kinds of Garbage Collection */
 #define KGC_NORMAL	0
 #define KGC_EMERGENCY	1	/* gc was forced by an allocation failure */
+#define KGC_GEN		2	/* generational collection */
 
 
 typedef struct stringtable {
@@ -162,6 +163,12 @@ typedef struct global_State {
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int genminormul;  /* control for minor generational collections */
+  int genmajormul;  /* control for major generational collections */
+  lu_mem gccycles;  /* number of finished mark phases */
+  l_mem (*gcclock) (void);  /* time source for 'gctime' (or NULL) */
+  l_mem gctimestamp;  /* last time charged to 'gctime' */
+  l_mem gctime[8];  /* time spent in each GC state */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
   const lua_Number *version;  /* pointer to version number */
@@ -56,12 +56,15 @@ public:
 	template <class FType, typename amx_hook_func<FType>::hook_ftype *Func>
 	struct ctl
 	{
-		static void load()
+		static void load(bool install = true)
 		{
 			typename amx_hook_func<FType>::handler_ftype *hookfn = &amx_hook_func<FType>::template handler<var::hook, Func>;
 
 			var::hook = subhook_new(reinterpret_cast<void*>(((FType*)pAMXFunctions)[Index]), reinterpret_cast<void*>(hookfn), {});
-			subhook_install(var::hook);
+			if(install)
+			{
+				subhook_install(var::hook);
+			}
 		}
 
 		static void unload()
@@ -234,21 +237,57 @@ namespace hooks
 	}
 }
 
+static int interop_count = 0;
+
 void hooks::load()
 {
 	amx_Hook(Init)::load();
 	amx_Hook(Register)::load();
 	amx_Hook(Exec)::load();
-	amx_Hook(FindPublic)::load();
-	amx_Hook(GetPublic)::load();
-	amx_Hook(NumPublics)::load();
-	amx_Hook(FindPubVar)::load();
-	amx_Hook(GetPubVar)::load();
-	amx_Hook(NumPubVars)::load();
-	amx_Hook(FindTagId)::load();
-	amx_Hook(GetTag)::load();
-	amx_Hook(NumTags)::load();
-	amx_Hook(GetAddr)::load();
+	amx_Hook(FindPublic)::load(false);
+	amx_Hook(GetPublic)::load(false);
+	amx_Hook(NumPublics)::load(false);
+	amx_Hook(FindPubVar)::load(false);
+	amx_Hook(GetPubVar)::load(false);
+	amx_Hook(NumPubVars)::load(false);
+	amx_Hook(FindTagId)::load(false);
+	amx_Hook(GetTag)::load(false);
+	amx_Hook(NumTags)::load(false);
+	amx_Hook(GetAddr)::load(false);
+}
+
+void hooks::acquire_interop()
+{
+	if(interop_count++ == 0)
+	{
+		amx_Hook(FindPublic)::install();
+		amx_Hook(GetPublic)::install();
+		amx_Hook(NumPublics)::install();
+		amx_Hook(FindPubVar)::install();
+		amx_Hook(GetPubVar)::install();
+		amx_Hook(NumPubVars)::install();
+		amx_Hook(FindTagId)::install();
+		amx_Hook(GetTag)::install();
+		amx_Hook(NumTags)::install();
+		amx_Hook(GetAddr)::install();
+	}
+}
+
+void hooks::release_interop()
+{
+	if(interop_count > 0 && --interop_count == 0)
+	{
+		amx_Hook(FindPublic)::uninstall();
+		amx_Hook(GetPublic)::uninstall();
+		amx_Hook(NumPublics)::uninstall();
+		amx_Hook(FindPubVar)::uninstall();
+		amx_Hook(GetPubVar)::uninstall();
+		amx_Hook(NumPubVars)::uninstall();
+		amx_Hook(FindTagId)::uninstall();
+		amx_Hook(GetTag)::uninstall();
+		amx_Hook(NumTags)::uninstall();
+		amx_Hook(GetAddr)::uninstall();
+	}
 }
 
 void hooks::unload()
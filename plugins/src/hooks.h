@@ -5,6 +5,8 @@ namespace hooks
 {
 	void load();
 	void unload();
+	void acquire_interop();
+	void release_interop();
 }
 
 #endif
@@ -0,0 +1,129 @@
+#include "budget.h"
+#include "timer.h"
+#include "lua_utils.h"
+
+#include <chrono>
+#include <memory>
+#include <algorithm>
+
+struct cpu_state
+{
+	int callback_usec;
+	int tick_usec;
+	int depth = 0;
+	unsigned int tick = 0;
+	long long tick_used = 0;
+	std::chrono::steady_clock::time_point deadline;
+};
+
+static unsigned int tick_count = 0;
+static const int hook_count = 1000;
+
+static cpu_state *getstate(lua_State *L)
+{
+	return *reinterpret_cast<cpu_state**>(lua_getextraspace(L));
+}
+
+static void budget_hook(lua_State *L, lua_Debug *ar)
+{
+	if(ar->event != LUA_HOOKCOUNT)
+	{
+		return;
+	}
+	auto state = getstate(L);
+	if(!state || state->depth == 0 || std::chrono::steady_clock::now() < state->deadline)
+	{
+		return;
+	}
+	if(lua::timer::preempt(L))
+	{
+		lua_yield(L, 0);
+		return;
+	}
+	lua_getinfo(L, "Sln", ar);
+	if(ar->currentline > 0)
+	{
+		lua_pushfstring(L, "%s:%d: ", ar->short_src, ar->currentline);
+	}else{
+		lua_pushfstring(L, "");
+	}
+	if(ar->name)
+	{
+		lua_pushfstring(L, "state %p exceeded its CPU budget in function '%s'", lua::mainthread(L), ar->name);
+	}else{
+		lua_pushfstring(L, "state %p exceeded its CPU budget in function <%s:%d>", lua::mainthread(L), ar->short_src, ar->linedefined);
+	}
+	lua_concat(L, 2);
+	lua_error(L);
+}
+
+void lua::budget::limit(lua_State *L, int callback_usec, int tick_usec)
+{
+	auto &ptr = *reinterpret_cast<cpu_state**>(lua_getextraspace(L));
+	ptr = nullptr;
+	if(callback_usec < 0 && tick_usec < 0)
+	{
+		return;
+	}
+	auto state = std::make_shared<cpu_state>();
+	state->callback_usec = callback_usec;
+	state->tick_usec = tick_usec;
+	ptr = state.get();
+	lua::pushuserdata(L, std::move(state));
+	luaL_ref(L, LUA_REGISTRYINDEX);
+	install(L);
+}
+
+bool lua::budget::limited(lua_State *L)
+{
+	return getstate(L) != nullptr;
+}
+
+bool lua::budget::install(lua_State *L)
+{
+	if(!getstate(L) || lua_gethook(L))
+	{
+		return false;
+	}
+	lua_sethook(L, budget_hook, LUA_MASKCOUNT, hook_count);
+	return true;
+}
+
+bool lua::budget::ishook(lua_Hook hook)
+{
+	return hook == budget_hook;
+}
+
+int lua::budget::pcall(lua_State *L, int nargs, int nresults)
+{
+	auto state = getstate(L);
+	if(!state || state->depth > 0)
+	{
+		return lua_pcall(L, nargs, nresults, 0);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	if(state->tick != tick_count)
+	{
+		state->tick = tick_count;
+		state->tick_used = 0;
+	}
+	long long allowed = state->callback_usec;
+	if(state->tick_usec >= 0 && (allowed < 0 || state->tick_usec - state->tick_used < allowed))
+	{
+		allowed = std::max(state->tick_usec - state->tick_used, 0LL);
+	}
+	state->deadline = start + std::chrono::microseconds(allowed);
+	install(L);
+
+	state->depth++;
+	int error = lua_pcall(L, nargs, nresults, 0);
+	state->depth--;
+	state->tick_used += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	return error;
+}
+
+void lua::budget::tick()
+{
+	tick_count++;
+}
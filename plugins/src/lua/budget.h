@@ -0,0 +1,19 @@
+#ifndef BUDGET_H_INCLUDED
+#define BUDGET_H_INCLUDED
+
+#include "lua/lualibs.h"
+
+namespace lua
+{
+	namespace budget
+	{
+		void limit(lua_State *L, int callback_usec, int tick_usec);
+		bool limited(lua_State *L);
+		bool install(lua_State *L);
+		bool ishook(lua_Hook hook);
+		int pcall(lua_State *L, int nargs, int nresults);
+		void tick();
+	}
+}
+
+#endif
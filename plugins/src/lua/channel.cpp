@@ -0,0 +1,278 @@
+#include "channel.h"
+#include "lua_utils.h"
+
+#include <atomic>
+#include <new>
+
+struct lua::channel::ring
+{
+	ucell mask;
+	std::atomic<ucell> head;
+	std::atomic<ucell> tail;
+	cell data[1];
+};
+
+using lua::channel::ring;
+
+static const char METAKEY = 0;
+
+static size_t ringsize(ucell capacity)
+{
+	return sizeof(ring) + (capacity - 1) * sizeof(cell);
+}
+
+static ucell roundcapacity(cell capacity)
+{
+	ucell size = 2;
+	while(size < static_cast<ucell>(capacity))
+	{
+		size <<= 1;
+	}
+	return size;
+}
+
+static ucell msglen(ring *ch, ucell head, ucell tail)
+{
+	ucell len = ch->data[head & ch->mask];
+	return len < tail - head ? len : tail - head - 1;
+}
+
+static void *channel_get(lua_State *L, int idx, size_t &length, bool &isconst)
+{
+	auto ch = reinterpret_cast<ring*>(lua_touserdata(L, idx));
+	length = (ch->mask + 1) * sizeof(cell);
+	isconst = false;
+	return ch->data;
+}
+
+static const lua::buffer_type channel_buf = {channel_get};
+
+static ring *checkchannel(lua_State *L, int idx)
+{
+	auto ch = lua::channel::tochannel(L, idx);
+	if(!ch)
+	{
+		luaL_argerror(L, idx, "channel expected");
+	}
+	return ch;
+}
+
+static int channel_push(lua_State *L)
+{
+	auto ch = checkchannel(L, 1);
+	int top = lua_gettop(L);
+	ucell len = top - 1;
+	if(len > ch->mask)
+	{
+		return luaL_argerror(L, 2, "message does not fit in the channel");
+	}
+	ucell tail = ch->tail.load(std::memory_order_relaxed);
+	ucell head = ch->head.load(std::memory_order_acquire);
+	if(ch->mask - (tail - head) < len)
+	{
+		lua_pushboolean(L, false);
+		return 1;
+	}
+	ch->data[tail & ch->mask] = len;
+	for(int i = 2; i <= top; i++)
+	{
+		cell value;
+		if(lua_isinteger(L, i))
+		{
+			value = static_cast<cell>(lua_tointeger(L, i));
+		}else if(lua_type(L, i) == LUA_TNUMBER)
+		{
+			float fval = static_cast<float>(lua_tonumber(L, i));
+			value = amx_ftoc(fval);
+		}else if(lua_isboolean(L, i))
+		{
+			value = lua_toboolean(L, i);
+		}else{
+			return luaL_argerror(L, i, "number or boolean expected");
+		}
+		ch->data[(tail + i - 1) & ch->mask] = value;
+	}
+	ch->tail.store(tail + len + 1, std::memory_order_release);
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+static int pushmessage(lua_State *L, ring *ch)
+{
+	ucell head = ch->head.load(std::memory_order_relaxed);
+	ucell tail = ch->tail.load(std::memory_order_acquire);
+	if(head == tail)
+	{
+		return -1;
+	}
+	ucell len = msglen(ch, head, tail);
+	luaL_checkstack(L, len, nullptr);
+	for(ucell i = 1; i <= len; i++)
+	{
+		lua_pushinteger(L, ch->data[(head + i) & ch->mask]);
+	}
+	ch->head.store(head + len + 1, std::memory_order_release);
+	return len;
+}
+
+static int channel_pop(lua_State *L)
+{
+	auto ch = checkchannel(L, 1);
+	int len = pushmessage(L, ch);
+	return len < 0 ? 0 : len;
+}
+
+static int channel_drain(lua_State *L)
+{
+	auto ch = checkchannel(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_Integer count = 0;
+	while(true)
+	{
+		lua_pushvalue(L, 2);
+		int len = pushmessage(L, ch);
+		if(len < 0)
+		{
+			lua_pop(L, 1);
+			break;
+		}
+		lua_call(L, len, 0);
+		count++;
+	}
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+static int channel_len(lua_State *L)
+{
+	auto ch = checkchannel(L, 1);
+	lua_pushinteger(L, lua::channel::pending(ch));
+	return 1;
+}
+
+static void pushmetatable(lua_State *L)
+{
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &METAKEY) == LUA_TTABLE)
+	{
+		return;
+	}
+	lua_pop(L, 1);
+
+	lua_createtable(L, 0, 5);
+	lua::pushliteral(L, "channel");
+	lua_setfield(L, -2, "__name");
+	lua_pushboolean(L, false);
+	lua_setfield(L, -2, "__metatable");
+	lua_pushcfunction(L, channel_len);
+	lua_setfield(L, -2, "__len");
+	lua_createtable(L, 0, 3);
+	lua_pushcfunction(L, channel_push);
+	lua_setfield(L, -2, "push");
+	lua_pushcfunction(L, channel_pop);
+	lua_setfield(L, -2, "pop");
+	lua_pushcfunction(L, channel_drain);
+	lua_setfield(L, -2, "drain");
+	lua_setfield(L, -2, "__index");
+	lua::setbuffertype(L, -1, channel_buf);
+
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &METAKEY);
+}
+
+ring *lua::channel::create(lua_State *L, cell capacity)
+{
+	ucell size = roundcapacity(capacity);
+	auto ch = reinterpret_cast<ring*>(lua_newuserdata(L, ringsize(size)));
+	ch->mask = size - 1;
+	new (&ch->head) std::atomic<ucell>(0);
+	new (&ch->tail) std::atomic<ucell>(0);
+	pushmetatable(L);
+	lua_setmetatable(L, -2);
+	return ch;
+}
+
+ring *lua::channel::tochannel(lua_State *L, int idx)
+{
+	idx = lua_absindex(L, idx);
+	if(!lua_getmetatable(L, idx))
+	{
+		return nullptr;
+	}
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &METAKEY);
+	bool ischannel = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return ischannel ? reinterpret_cast<ring*>(lua_touserdata(L, idx)) : nullptr;
+}
+
+int lua::channel::newchannel(lua_State *L)
+{
+	auto capacity = luaL_checkinteger(L, 1);
+	if(capacity < 2 || capacity > max_capacity)
+	{
+		return luaL_argerror(L, 1, "out of range");
+	}
+	create(L, static_cast<cell>(capacity));
+	return 1;
+}
+
+bool lua::channel::write(ring *ch, const cell *src, cell len)
+{
+	ucell tail = ch->tail.load(std::memory_order_relaxed);
+	ucell head = ch->head.load(std::memory_order_acquire);
+	if(len < 0 || ch->mask - (tail - head) < static_cast<ucell>(len))
+	{
+		return false;
+	}
+	ch->data[tail & ch->mask] = len;
+	for(cell i = 0; i < len; i++)
+	{
+		ch->data[(tail + i + 1) & ch->mask] = src[i];
+	}
+	ch->tail.store(tail + len + 1, std::memory_order_release);
+	return true;
+}
+
+cell lua::channel::read(ring *ch, cell *dest, cell size)
+{
+	ucell head = ch->head.load(std::memory_order_relaxed);
+	ucell tail = ch->tail.load(std::memory_order_acquire);
+	if(head == tail)
+	{
+		return -1;
+	}
+	cell len = msglen(ch, head, tail);
+	for(cell i = 0; i < len && i < size; i++)
+	{
+		dest[i] = ch->data[(head + i + 1) & ch->mask];
+	}
+	ch->head.store(head + len + 1, std::memory_order_release);
+	return len;
+}
+
+cell lua::channel::drain(ring *ch, cell *dest, cell size)
+{
+	ucell head = ch->head.load(std::memory_order_relaxed);
+	ucell tail = ch->tail.load(std::memory_order_acquire);
+	cell written = 0;
+	while(head != tail)
+	{
+		cell len = msglen(ch, head, tail);
+		if(written + len + 1 > size)
+		{
+			break;
+		}
+		dest[written++] = len;
+		for(cell i = 1; i <= len; i++)
+		{
+			dest[written++] = ch->data[(head + i) & ch->mask];
+		}
+		head += len + 1;
+	}
+	ch->head.store(head, std::memory_order_release);
+	return written;
+}
+
+cell lua::channel::pending(ring *ch)
+{
+	return static_cast<cell>(ch->tail.load(std::memory_order_acquire) - ch->head.load(std::memory_order_acquire));
+}
@@ -0,0 +1,25 @@
+#ifndef CHANNEL_H_INCLUDED
+#define CHANNEL_H_INCLUDED
+
+#include "lua/lualibs.h"
+#include "sdk/amx/amx.h"
+
+namespace lua
+{
+	namespace channel
+	{
+		struct ring;
+
+		const cell max_capacity = 1 << 24;
+
+		ring *create(lua_State *L, cell capacity);
+		ring *tochannel(lua_State *L, int idx);
+		int newchannel(lua_State *L);
+		bool write(ring *ch, const cell *src, cell len);
+		cell read(ring *ch, cell *dest, cell size);
+		cell drain(ring *ch, cell *dest, cell size);
+		cell pending(ring *ch);
+	}
+}
+
+#endif
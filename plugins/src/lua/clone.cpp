@@ -0,0 +1,466 @@
+#include "clone.h"
+#include "lua_utils.h"
+
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+#include "lua/lfunc.h"
+#include "lua/lgc.h"
+#include "lua/lmem.h"
+#include "lua/lstring.h"
+#include "lua/ltable.h"
+#include "lua/ldo.h"
+
+#include <unordered_map>
+#include <cstring>
+
+class cloner
+{
+	lua_State *from;
+	lua_State *to;
+	int memo;
+	int nmemo = 0;
+	std::unordered_map<const void*, int> seen;
+	std::unordered_map<const Proto*, Proto*> protos;
+	std::unordered_map<void*, UpVal*> upvals;
+
+	TString *copystring(Proto *f, const TString *str)
+	{
+		if(!str)
+		{
+			return nullptr;
+		}
+		TString *s = luaS_newlstr(to, getstr(str), tsslen(str));
+		// f may already be black; the caller stores s without allocating
+		luaC_objbarrier(to, f, s);
+		return s;
+	}
+
+	void copyproto(Proto *f, const Proto *p)
+	{
+		f->numparams = p->numparams;
+		f->is_vararg = p->is_vararg;
+		f->maxstacksize = p->maxstacksize;
+		f->linedefined = p->linedefined;
+		f->lastlinedefined = p->lastlinedefined;
+		f->source = copystring(f, p->source);
+
+		f->code = luaM_newvector(to, p->sizecode, Instruction);
+		f->sizecode = p->sizecode;
+		std::memcpy(f->code, p->code, p->sizecode * sizeof(Instruction));
+
+		f->k = luaM_newvector(to, p->sizek, TValue);
+		f->sizek = p->sizek;
+		for(int i = 0; i < p->sizek; i++)
+		{
+			setnilvalue(&f->k[i]);
+		}
+		for(int i = 0; i < p->sizek; i++)
+		{
+			const TValue *o = &p->k[i];
+			if(ttisstring(o))
+			{
+				setsvalue2n(to, &f->k[i], copystring(f, tsvalue(o)));
+			}else{
+				setobj(to, &f->k[i], o);
+			}
+		}
+
+		f->upvalues = luaM_newvector(to, p->sizeupvalues, Upvaldesc);
+		f->sizeupvalues = p->sizeupvalues;
+		for(int i = 0; i < p->sizeupvalues; i++)
+		{
+			f->upvalues[i].name = nullptr;
+		}
+		for(int i = 0; i < p->sizeupvalues; i++)
+		{
+			f->upvalues[i].instack = p->upvalues[i].instack;
+			f->upvalues[i].idx = p->upvalues[i].idx;
+			f->upvalues[i].name = copystring(f, p->upvalues[i].name);
+		}
+
+		f->p = luaM_newvector(to, p->sizep, Proto*);
+		f->sizep = p->sizep;
+		for(int i = 0; i < p->sizep; i++)
+		{
+			f->p[i] = nullptr;
+		}
+		for(int i = 0; i < p->sizep; i++)
+		{
+			bool fresh;
+			f->p[i] = findproto(p->p[i], fresh);
+			luaC_objbarrier(to, f, f->p[i]);
+			if(fresh)
+			{
+				copyproto(f->p[i], p->p[i]);
+			}
+		}
+
+		f->lineinfo = luaM_newvector(to, p->sizelineinfo, int);
+		f->sizelineinfo = p->sizelineinfo;
+		std::memcpy(f->lineinfo, p->lineinfo, p->sizelineinfo * sizeof(int));
+
+		f->locvars = luaM_newvector(to, p->sizelocvars, LocVar);
+		f->sizelocvars = p->sizelocvars;
+		for(int i = 0; i < p->sizelocvars; i++)
+		{
+			f->locvars[i].varname = nullptr;
+		}
+		for(int i = 0; i < p->sizelocvars; i++)
+		{
+			f->locvars[i].varname = copystring(f, p->locvars[i].varname);
+			f->locvars[i].startpc = p->locvars[i].startpc;
+			f->locvars[i].endpc = p->locvars[i].endpc;
+		}
+	}
+
+	Proto *findproto(const Proto *p, bool &fresh)
+	{
+		auto it = protos.find(p);
+		fresh = it == protos.end();
+		if(!fresh)
+		{
+			return it->second;
+		}
+		auto f = luaF_newproto(to);
+		protos[p] = f;
+		return f;
+	}
+
+	bool known(int idx)
+	{
+		return seen.find(lua_topointer(from, idx)) != seen.end();
+	}
+
+	bool memoized(int idx)
+	{
+		auto it = seen.find(lua_topointer(from, idx));
+		if(it == seen.end())
+		{
+			return false;
+		}
+		lua_rawgeti(to, memo, it->second);
+		return true;
+	}
+
+	void remember(int idx)
+	{
+		lua_pushvalue(to, -1);
+		lua_rawseti(to, memo, ++nmemo);
+		seen[lua_topointer(from, idx)] = nmemo;
+	}
+
+	void copytable(int idx)
+	{
+		auto t = reinterpret_cast<const Table*>(lua_topointer(from, idx));
+		lua_createtable(to, t->sizearray, allocsizenode(t));
+		remember(idx);
+		merge(idx, lua_gettop(to));
+		if(lua_getmetatable(from, idx))
+		{
+			copy(-1);
+			lua_setmetatable(to, -2);
+			lua_pop(from, 1);
+		}
+	}
+
+	void copyluaclosure(int idx)
+	{
+		auto cl = reinterpret_cast<LClosure*>(const_cast<void*>(lua_topointer(from, idx)));
+		int nup = cl->nupvalues;
+		LClosure *ncl = luaF_newLclosure(to, nup);
+		setclLvalue(to, to->top, ncl);
+		luaD_inctop(to);
+		remember(idx);
+
+		bool fresh;
+		ncl->p = findproto(cl->p, fresh);
+		luaC_objbarrier(to, ncl, ncl->p);
+		if(fresh)
+		{
+			copyproto(ncl->p, cl->p);
+		}
+
+		for(int i = 0; i < nup; i++)
+		{
+			void *id = lua_upvalueid(from, idx, i + 1);
+			auto it = upvals.find(id);
+			if(it != upvals.end())
+			{
+				ncl->upvals[i] = it->second;
+				it->second->refcount++;
+				continue;
+			}
+			UpVal *uv = luaM_new(to, UpVal);
+			uv->refcount = 1;
+			uv->v = &uv->u.value;
+			setnilvalue(uv->v);
+			ncl->upvals[i] = uv;
+			upvals[id] = uv;
+
+			lua_getupvalue(from, idx, i + 1);
+			copy(-1);
+			setobj(to, uv->v, to->top - 1);
+			luaC_upvalbarrier(to, uv);
+			lua_pop(to, 1);
+			lua_pop(from, 1);
+		}
+	}
+
+	bool ownsnative(int idx)
+	{
+		for(int i = 1; lua_getupvalue(from, idx, i); i++)
+		{
+			int type = lua_type(from, -1);
+			lua_pop(from, 1);
+			if(type == LUA_TUSERDATA || type == LUA_TLIGHTUSERDATA || type == LUA_TTHREAD)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void copycclosure(int idx)
+	{
+		if(ownsnative(idx))
+		{
+			// bound to objects of the template state
+			lua_pushnil(to);
+			return;
+		}
+		auto f = lua_tocfunction(from, idx);
+		int nup = 0;
+		while(lua_getupvalue(from, idx, nup + 1))
+		{
+			copy(-1);
+			lua_pop(from, 1);
+			nup++;
+		}
+		lua_pushcclosure(to, f, nup);
+		if(nup > 0)
+		{
+			remember(idx);
+		}
+	}
+
+public:
+	cloner(lua_State *from, lua_State *to) : from(from), to(to)
+	{
+		lua_newtable(to);
+		memo = lua_gettop(to);
+	}
+
+	~cloner()
+	{
+		lua_remove(to, memo);
+	}
+
+	void copy(int idx)
+	{
+		idx = lua_absindex(from, idx);
+		if(!lua_checkstack(from, 4) || !lua_checkstack(to, 6))
+		{
+			luaL_error(to, "stack overflow while cloning state");
+		}
+		switch(lua_type(from, idx))
+		{
+			case LUA_TBOOLEAN:
+				lua_pushboolean(to, lua_toboolean(from, idx));
+				break;
+			case LUA_TLIGHTUSERDATA:
+				lua_pushlightuserdata(to, lua_touserdata(from, idx));
+				break;
+			case LUA_TNUMBER:
+				if(lua_isinteger(from, idx))
+				{
+					lua_pushinteger(to, lua_tointeger(from, idx));
+				}else{
+					lua_pushnumber(to, lua_tonumber(from, idx));
+				}
+				break;
+			case LUA_TSTRING:
+			{
+				size_t len;
+				auto str = lua_tolstring(from, idx, &len);
+				lua_pushlstring(to, str, len);
+			}
+			break;
+			case LUA_TTABLE:
+				if(!memoized(idx))
+				{
+					copytable(idx);
+				}
+				break;
+			case LUA_TFUNCTION:
+				if(!memoized(idx))
+				{
+					if(lua_iscfunction(from, idx))
+					{
+						copycclosure(idx);
+					}else{
+						copyluaclosure(idx);
+					}
+				}
+				break;
+			default:
+				// userdata and threads belong to their state
+				lua_pushnil(to);
+				break;
+		}
+	}
+
+	void merge(int fidx, int tidx)
+	{
+		fidx = lua_absindex(from, fidx);
+		tidx = lua_absindex(to, tidx);
+		lua_pushnil(from);
+		while(lua_next(from, fidx))
+		{
+			copy(-2);
+			if(lua_isnil(to, -1))
+			{
+				lua_pop(to, 1);
+				lua_pop(from, 1);
+				continue;
+			}
+			lua_pushvalue(to, -1);
+			lua_rawget(to, tidx);
+			if(lua_istable(from, -1) && lua_istable(to, -1) && !known(-1))
+			{
+				// a library table the new state already has; fill in what the template added
+				link(-1, -1);
+				merge(-1, -1);
+				lua_pop(to, 2);
+			}else if(lua_iscfunction(from, -1) && lua_tocfunction(from, -1) == lua_tocfunction(to, -1))
+			{
+				lua_pop(to, 2);
+			}else{
+				lua_pop(to, 1);
+				copy(-1);
+				if(lua_isnil(to, -1))
+				{
+					lua_pop(to, 2);
+				}else{
+					lua_rawset(to, tidx);
+				}
+			}
+			lua_pop(from, 1);
+		}
+	}
+
+	void reload(int fidx, int tidx)
+	{
+		fidx = lua_absindex(from, fidx);
+		tidx = lua_absindex(to, tidx);
+		if(lua_getfield(to, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE) != LUA_TTABLE)
+		{
+			lua_pop(to, 1);
+			return;
+		}
+		int preload = lua_gettop(to);
+		lua_pushnil(from);
+		while(lua_next(from, fidx))
+		{
+			if(lua_type(from, -2) != LUA_TSTRING)
+			{
+				lua_pop(from, 1);
+				continue;
+			}
+			const char *name = lua_tostring(from, -2);
+			if(lua_getfield(to, tidx, name) != LUA_TNIL || lua_getfield(to, preload, name) != LUA_TFUNCTION)
+			{
+				lua_settop(to, preload);
+				lua_pop(from, 1);
+				continue;
+			}
+			// run the loader again so the module gets native state of its own
+			lua_remove(to, -2);
+			lua_pushstring(to, name);
+			lua::pushliteral(to, ":preload:");
+			lua_call(to, 2, 1);
+			if(!lua_isnil(to, -1))
+			{
+				lua_setfield(to, tidx, name);
+			}else{
+				lua_pop(to, 1);
+			}
+			if(lua_getfield(to, tidx, name) == LUA_TNIL)
+			{
+				lua_pop(to, 1);
+				lua_pushboolean(to, true);
+				lua_pushvalue(to, -1);
+				lua_setfield(to, tidx, name);
+			}
+			if(lua_istable(from, -1) && lua_istable(to, -1) && !known(-1))
+			{
+				link(-1, -1);
+				relink(-1, -1);
+			}
+			lua_settop(to, preload);
+			lua_pop(from, 1);
+		}
+		lua_pop(to, 1);
+	}
+
+	void relink(int fidx, int tidx)
+	{
+		fidx = lua_absindex(from, fidx);
+		tidx = lua_absindex(to, tidx);
+		if(!lua_checkstack(from, 3) || !lua_checkstack(to, 2))
+		{
+			luaL_error(to, "stack overflow while cloning state");
+		}
+		lua_pushnil(from);
+		while(lua_next(from, fidx))
+		{
+			if(lua_type(from, -2) != LUA_TSTRING || known(-1))
+			{
+				lua_pop(from, 1);
+				continue;
+			}
+			// may build lazy fields the template had already accessed
+			lua_getfield(to, tidx, lua_tostring(from, -2));
+			if(lua_istable(from, -1) && lua_istable(to, -1))
+			{
+				link(-1, -1);
+				relink(-1, -1);
+			}else if(lua_iscfunction(from, -1) && lua_tocfunction(from, -1) == lua_tocfunction(to, -1))
+			{
+				link(-1, -1);
+			}
+			lua_pop(to, 1);
+			lua_pop(from, 1);
+		}
+	}
+
+	void link(int fidx, int tidx)
+	{
+		lua_pushvalue(to, tidx);
+		lua_rawseti(to, memo, ++nmemo);
+		seen[lua_topointer(from, fidx)] = nmemo;
+	}
+};
+
+void lua::clone(lua_State *from, lua_State *to)
+{
+	cloner c(from, to);
+
+	lua_rawgeti(from, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+	lua_rawgeti(to, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+	c.link(-1, -1);
+
+	lua_getfield(from, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	lua_getfield(to, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	if(lua_istable(from, -1) && lua_istable(to, -1))
+	{
+		c.link(-1, -1);
+		c.reload(-1, -1);
+		c.merge(-1, -1);
+	}
+	lua_pop(from, 1);
+	lua_pop(to, 1);
+
+	c.merge(-1, -1);
+	lua_pop(from, 1);
+	lua_pop(to, 1);
+}
@@ -0,0 +1,11 @@
+#ifndef CLONE_H_INCLUDED
+#define CLONE_H_INCLUDED
+
+#include "lua/lualibs.h"
+
+namespace lua
+{
+	void clone(lua_State *from, lua_State *to);
+}
+
+#endif
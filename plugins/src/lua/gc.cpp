@@ -0,0 +1,248 @@
+#include "gc.h"
+#include "lua_utils.h"
+#include "lua_api.h"
+#include "lua/lstate.h"
+#include "lua/lgc.h"
+#include "lua/lfunc.h"
+#include "lua/lstring.h"
+#include "lua/ltable.h"
+
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+
+struct gc_state
+{
+	lua_State *L;
+	int pause;
+	std::shared_ptr<lua::gc::memstats> stats;
+};
+
+static std::vector<std::weak_ptr<gc_state>> states;
+static size_t next_state = 0;
+static int tick_budget = 1000;
+
+static l_mem clock_usec()
+{
+	return (l_mem)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void lua::gc::memstats::alloc(void *ptr, size_t osize, size_t nsize)
+{
+	if(ptr != nullptr)
+	{
+		total -= osize;
+	}else{
+		osize = 0;
+	}
+	total += nsize;
+	if(nsize > osize)
+	{
+		allocated += nsize - osize;
+	}
+	if(total > peak)
+	{
+		peak = total;
+	}
+}
+
+std::shared_ptr<lua::gc::memstats> lua::gc::schedule(lua_State *L)
+{
+	auto ptr = std::make_shared<gc_state>();
+	ptr->L = L;
+	ptr->pause = lua_gc(L, LUA_GCSETPAUSE, 0);
+	lua_gc(L, LUA_GCSETPAUSE, ptr->pause * 2);
+	ptr->stats = std::make_shared<memstats>();
+	ptr->stats->total = ptr->stats->peak = gettotalbytes(G(L));
+	G(L)->gcclock = clock_usec;
+	auto stats = ptr->stats;
+	states.push_back(ptr);
+	lua::pushuserdata(L, std::move(ptr));
+	luaL_ref(L, LUA_REGISTRYINDEX);
+	return stats;
+}
+
+static size_t objsize(GCObject *o)
+{
+	switch(o->tt)
+	{
+		case LUA_TSHRSTR:
+			return sizelstring(gco2ts(o)->shrlen);
+		case LUA_TLNGSTR:
+			return sizelstring(gco2ts(o)->u.lnglen);
+		case LUA_TTABLE:
+		{
+			Table *h = gco2t(o);
+			return sizeof(Table) + sizeof(TValue) * h->sizearray + sizeof(Node) * allocsizenode(h);
+		}
+		case LUA_TLCL:
+			return sizeLclosure(gco2lcl(o)->nupvalues);
+		case LUA_TCCL:
+			return sizeCclosure(gco2ccl(o)->nupvalues);
+		case LUA_TUSERDATA:
+			return sizeudata(gco2u(o));
+		case LUA_TTHREAD:
+		{
+			lua_State *th = gco2th(o);
+			return LUA_EXTRASPACE + sizeof(lua_State) + sizeof(TValue) * th->stacksize + sizeof(CallInfo) * th->nci;
+		}
+		case LUA_TPROTO:
+		{
+			Proto *f = gco2p(o);
+			return sizeof(Proto) + sizeof(Instruction) * f->sizecode + sizeof(Proto*) * f->sizep + sizeof(TValue) * f->sizek +
+				sizeof(int) * f->sizelineinfo + sizeof(LocVar) * f->sizelocvars + sizeof(Upvaldesc) * f->sizeupvalues;
+		}
+		default:
+			return 0;
+	}
+}
+
+static void countobjects(lua::gc::memstats &stats, GCObject *o)
+{
+	for(; o != nullptr; o = o->next)
+	{
+		size_t size = objsize(o);
+		switch(o->tt)
+		{
+			case LUA_TSHRSTR:
+			case LUA_TLNGSTR:
+				stats.string += size;
+				break;
+			case LUA_TTABLE:
+				stats.table += size;
+				break;
+			case LUA_TLCL:
+			case LUA_TCCL:
+				stats.function += size;
+				break;
+			case LUA_TUSERDATA:
+				stats.userdata += size;
+				break;
+			case LUA_TTHREAD:
+				stats.thread += size;
+				break;
+			case LUA_TPROTO:
+				stats.proto += size;
+				break;
+		}
+	}
+}
+
+bool lua::gc::getstats(lua_State *L, memstats &stats)
+{
+	global_State *g = G(L);
+	bool tracked = false;
+	for(const auto &ptr : states)
+	{
+		auto lock = ptr.lock();
+		if(lock && G(lock->L) == g)
+		{
+			stats = *lock->stats;
+			tracked = true;
+			break;
+		}
+	}
+	if(!tracked)
+	{
+		stats = memstats();
+		stats.total = stats.peak = gettotalbytes(g);
+	}
+	stats.table = stats.string = stats.function = stats.userdata = stats.thread = stats.proto = 0;
+	countobjects(stats, g->allgc);
+	countobjects(stats, g->finobj);
+	countobjects(stats, g->tobefnz);
+	countobjects(stats, g->fixedgc);
+	stats.thread += objsize(obj2gco(g->mainthread));
+
+	stats.cycles = (size_t)g->gccycles;
+	stats.propagate_time = g->gctime[GCSpropagate] + g->gctime[GCSpause];
+	stats.atomic_time = g->gctime[GCSatomic];
+	stats.sweep_time = g->gctime[GCSswpallgc] + g->gctime[GCSswpfinobj] + g->gctime[GCSswptobefnz] + g->gctime[GCSswpend];
+	stats.finalize_time = g->gctime[GCScallfin];
+	return tracked;
+}
+
+int lua::gc::budget(int usec)
+{
+	int old = tick_budget;
+	if(usec >= 0)
+	{
+		tick_budget = usec;
+	}
+	return old;
+}
+
+static bool wants_step(lua_State *L, int pause)
+{
+	global_State *g = G(L);
+	if(!g->gcrunning)
+	{
+		return false;
+	}
+	if(g->gckind == KGC_GEN)
+	{
+		lu_mem base = g->GCestimate > 0 ? g->GCestimate : gettotalbytes(g);
+		return g->GCdebt > -(l_mem)((base / 100) * g->genminormul / 2);
+	}
+	if(g->gcstate != GCSpause)
+	{
+		return true;
+	}
+	return gettotalbytes(g) >= (g->GCestimate / 100) * pause;
+}
+
+static int step(lua_State *L)
+{
+	auto deadline = *reinterpret_cast<std::chrono::steady_clock::time_point*>(lua_touserdata(L, 1));
+	do{
+		if(lua_gc(L, LUA_GCSTEP, 0))
+		{
+			break;
+		}
+	}while(std::chrono::steady_clock::now() < deadline);
+	return 0;
+}
+
+void lua::gc::tick()
+{
+	states.erase(std::remove_if(states.begin(), states.end(), [](const std::weak_ptr<gc_state> &ptr)
+	{
+		return ptr.expired();
+	}), states.end());
+
+	for(const auto &ptr : states)
+	{
+		auto &stats = *ptr.lock()->stats;
+		stats.tick = (size_t)(stats.allocated - stats.tick_start);
+		stats.tick_start = stats.allocated;
+	}
+
+	if(states.empty() || tick_budget <= 0)
+	{
+		return;
+	}
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(tick_budget);
+	for(size_t i = 0; i < states.size() && std::chrono::steady_clock::now() < deadline; i++)
+	{
+		if(next_state >= states.size())
+		{
+			next_state = 0;
+		}
+		auto lock = states[next_state++].lock();
+		auto L = lock->L;
+		if(lua::active(L) || !wants_step(L, lock->pause))
+		{
+			continue;
+		}
+		lua_pushcfunction(L, step);
+		lua_pushlightuserdata(L, &deadline);
+		int error = lua_pcall(L, 1, 0, 0);
+		if(error != LUA_OK)
+		{
+			lua::report_error(L, error);
+			lua_pop(L, 1);
+		}
+	}
+}
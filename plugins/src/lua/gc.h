@@ -0,0 +1,43 @@
+#ifndef GC_H_INCLUDED
+#define GC_H_INCLUDED
+
+#include "lua/lualibs.h"
+
+#include <memory>
+
+namespace lua
+{
+	namespace gc
+	{
+		struct memstats
+		{
+			size_t total = 0;
+			size_t peak = 0;
+			unsigned long long allocated = 0;
+			unsigned long long tick_start = 0;
+			size_t tick = 0;
+
+			size_t table = 0;
+			size_t string = 0;
+			size_t function = 0;
+			size_t userdata = 0;
+			size_t thread = 0;
+			size_t proto = 0;
+
+			size_t cycles = 0;
+			long long propagate_time = 0;
+			long long atomic_time = 0;
+			long long sweep_time = 0;
+			long long finalize_time = 0;
+
+			void alloc(void *ptr, size_t osize, size_t nsize);
+		};
+
+		std::shared_ptr<memstats> schedule(lua_State *L);
+		bool getstats(lua_State *L, memstats &stats);
+		void tick();
+		int budget(int usec);
+	}
+}
+
+#endif
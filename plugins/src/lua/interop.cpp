@@ -1,12 +1,15 @@
 #include "interop.h"
 #include "lua_utils.h"
 #include "lua_api.h"
+#include "hooks.h"
 #include "amx/amxutils.h"
 #include "amx/loader.h"
 #include "interop/native.h"
 #include "interop/public.h"
 #include "interop/pubvar.h"
 #include "interop/memory.h"
+#include "interop/view.h"
+#include "interop/layout.h"
 #include "interop/string.h"
 #include "interop/result.h"
 #include "interop/file.h"
@@ -17,8 +20,7 @@
 #include <memory>
 #include <string>
 #include <limits>
-
-std::unordered_map<AMX*, std::weak_ptr<class amx_info>> amx_map;
+#include <cstring>
 
 class amx_info
 {
@@ -35,7 +37,10 @@ public:
 
 	~amx_info()
 	{
-		amx_map.erase(amx);
+		if(amx)
+		{
+			lua::interop::free_record(amx);
+		}
 		if(amx && !fs_name.empty() && amx::Unload(fs_name.c_str()))
 		{
 			amx = nullptr;
@@ -128,32 +133,177 @@ int forward(lua_State *L)
 	}
 }
 
-int lua::interop::loader(lua_State *L)
+enum interop_group
 {
-	auto ptr = std::make_shared<amx_info>(lua::mainthread(L));
-	amx_info &info = *ptr;
-	lua::pushuserdata(L, ptr);
-	auto loader = [&](AMX *amx, void *program)
+	group_sleep,
+	group_native,
+	group_public,
+	group_memory,
+	group_view,
+	group_layout,
+	group_string,
+	group_result,
+	group_file,
+	group_tags,
+};
+
+static const struct
+{
+	const char *name;
+	interop_group group;
+} lazy_fields[] = {
+	{"sleep", group_sleep},
+	{"native", group_native},
+	{"getnative", group_native},
+	{"public", group_public},
+	{"await", group_public},
+	{"forward", group_public},
+	{"loopback", group_public},
+	{"newbuffer", group_memory},
+	{"tobuffer", group_memory},
+	{"tocbuffer", group_memory},
+	{"asbuffer", group_memory},
+	{"heap", group_memory},
+	{"span", group_memory},
+	{"heapalloc", group_memory},
+	{"heapfree", group_memory},
+	{"toheap", group_memory},
+	{"struct", group_memory},
+	{"heapargs", group_memory},
+	{"vacall", group_memory},
+	{"view", group_view},
+	{"layout", group_layout},
+	{"getstring", group_string},
+	{"setstring", group_string},
+	{"asstring", group_string},
+	{"tocellstring", group_string},
+	{"asnone", group_result},
+	{"asnil", group_result},
+	{"asinteger", group_result},
+	{"asuinteger", group_result},
+	{"asboolean", group_result},
+	{"asfloat", group_result},
+	{"asoffset", group_result},
+	{"ashandle", group_result},
+	{"asfile", group_file},
+	{"asnewfile", group_file},
+	{"closefile", group_file},
+	{"tofile", group_file},
+	{"tagof", group_tags},
+	{"tagname", group_tags},
+};
+
+static void init_group(lua_State *L, AMX *amx, interop_group group)
+{
+	using namespace lua::interop;
+
+	switch(group)
 	{
-		std::unordered_map<cell, std::string> tagcache;
+		case group_sleep:
+			init_sleep(L, amx);
+			break;
+		case group_native:
+			init_native(L, amx);
+			break;
+		case group_public:
+			lua_newtable(L);
+			lua_setfield(L, -2, "public");
+
+			init_public(L, amx);
+			init_pubvar(L, amx);
 
-		int nlen;
-		amx_NameLength(amx, &nlen);
+			lua_getfield(L, -1, "public");
+			lua_pushlightuserdata(L, amx);
+			lua_pushcclosure(L, forward, 2);
+			lua_setfield(L, -2, "forward");
 
-		auto tagname = reinterpret_cast<char*>(alloca(nlen + 1));
-		int numtags;
-		amx_NumTags(amx, &numtags);
-		for(int i = 0; i < numtags; i++)
+			lua::pushstring(L, "#lua");
+			lua_setfield(L, -2, "loopback");
+			lua_pop(L, 1);
+			break;
+		case group_memory:
+			init_memory(L, amx);
+			break;
+		case group_view:
+			init_view(L, amx);
+			break;
+		case group_layout:
+			init_layout(L, amx);
+			break;
+		case group_string:
+			init_string(L, amx);
+			break;
+		case group_result:
+			init_result(L, amx);
+			break;
+		case group_file:
+			init_file(L, amx);
+			break;
+		case group_tags:
 		{
-			cell tag_id;
-			amx_GetTag(amx, i, tagname, &tag_id);
+			std::unordered_map<cell, std::string> tagcache;
+
+			int nlen;
+			amx_NameLength(amx, &nlen);
+
+			auto tagname = reinterpret_cast<char*>(alloca(nlen + 1));
+			int numtags;
+			amx_NumTags(amx, &numtags);
+			for(int i = 0; i < numtags; i++)
+			{
+				cell tag_id;
+				amx_GetTag(amx, i, tagname, &tag_id);
+
+				tagcache[tag_id] = tagname;
+			}
+
+			init_tags(L, amx, tagcache);
+		}
+		break;
+	}
+}
+
+static int interop_index(lua_State *L)
+{
+	if(lua_type(L, 2) != LUA_TSTRING)
+	{
+		return 0;
+	}
+	auto key = lua_tostring(L, 2);
+	for(const auto &field : lazy_fields)
+	{
+		if(std::strcmp(field.name, key) == 0)
+		{
+			auto mask = lua_tointeger(L, lua_upvalueindex(2));
+			if(mask & (1 << field.group))
+			{
+				return 0;
+			}
+			lua_pushinteger(L, mask | (1 << field.group));
+			lua_replace(L, lua_upvalueindex(2));
 
-			tagcache[tag_id] = tagname;
+			auto amx = reinterpret_cast<AMX*>(lua_touserdata(L, lua_upvalueindex(1)));
+			lua_settop(L, 2);
+			lua_pushvalue(L, 1);
+			init_group(L, amx, field.group);
+			lua_settop(L, 2);
+			lua_rawget(L, 1);
+			return 1;
 		}
+	}
+	return 0;
+}
 
+int lua::interop::loader(lua_State *L)
+{
+	auto ptr = std::make_shared<amx_info>(lua::mainthread(L));
+	amx_info &info = *ptr;
+	lua::pushuserdata(L, ptr);
+	auto loader = [&](AMX *amx, void *program)
+	{
 		info.amx = amx;
 		info.self = luaL_ref(L, LUA_REGISTRYINDEX);
-		amx_map[amx] = ptr;
+		lua::interop::make_record(amx).info = ptr;
 
 		lua_newtable(L);
 
@@ -162,26 +312,13 @@ int lua::interop::loader(lua_State *L)
 		lua_pushinteger(L, std::numeric_limits<cell>::max());
 		lua_setfield(L, -2, "cellmax");
 
-		lua_newtable(L);
-		lua_setfield(L, -2, "public");
-
-		init_sleep(L, amx);
-		init_native(L, amx);
-		init_public(L, amx);
-		init_pubvar(L, amx);
-		init_memory(L, amx);
-		init_string(L, amx);
-		init_result(L, amx);
-		init_file(L, amx);
-		init_tags(L, amx, tagcache);
-
-		lua_getfield(L, -1, "public");
+		// sub-libraries are built on first access
+		lua_createtable(L, 0, 1);
 		lua_pushlightuserdata(L, amx);
-		lua_pushcclosure(L, forward, 2);
-		lua_setfield(L, -2, "forward");
-
-		lua::pushstring(L, "#lua");
-		lua_setfield(L, -2, "loopback");
+		lua_pushinteger(L, 0);
+		lua_pushcclosure(L, interop_index, 2);
+		lua_setfield(L, -2, "__index");
+		lua_setmetatable(L, -2);
 	};
 
 	AMX *amx = lua::bound_amx(L);
@@ -207,19 +344,68 @@ bool lua::interop::amx_get_addr(AMX *amx, cell amx_addr, cell **phys_addr)
 	return amx_get_param_addr(amx, amx_addr, phys_addr) || amx_get_pubvar_addr(amx, amx_addr, phys_addr);
 }
 
+static std::unordered_map<AMX*, lua::interop::amx_record*> overflow_map;
+size_t lua::interop::overflow_records = 0;
+
+lua::interop::amx_record *lua::interop::find_overflow_record(AMX *amx)
+{
+	auto it = overflow_map.find(amx);
+	if(it != overflow_map.end())
+	{
+		return it->second;
+	}
+	return nullptr;
+}
+
+lua::interop::amx_record &lua::interop::make_record(AMX *amx)
+{
+	if(auto record = get_record(amx))
+	{
+		return *record;
+	}
+	auto record = new amx_record();
+	hooks::acquire_interop();
+	if(amx_SetUserData(amx, record_tag, record) != AMX_ERR_NONE)
+	{
+		// all user data slots are taken by other plugins
+		overflow_map[amx] = record;
+		overflow_records = overflow_map.size();
+	}
+	return *record;
+}
+
+void lua::interop::free_record(AMX *amx)
+{
+	if(auto record = get_record(amx))
+	{
+		for(int i = 0; i < AMX_USERNUM; i++)
+		{
+			if(amx->usertags[i] == record_tag)
+			{
+				amx->usertags[i] = 0;
+				amx->userdata[i] = nullptr;
+			}
+		}
+		if(overflow_map.erase(amx))
+		{
+			overflow_records = overflow_map.size();
+		}
+		delete record;
+		hooks::release_interop();
+	}
+}
+
 void lua::interop::amx_unload(AMX *amx)
 {
-	auto it = amx_map.find(amx);
-	if(it != amx_map.end())
+	if(auto record = get_record(amx))
 	{
-		if(auto lock = it->second.lock())
+		if(auto lock = record->info.lock())
 		{
 			lock->amx = nullptr;
 			lua_close(lock->L);
 			lua::cleanup(lock->L);
-		}else{
-			amx_map.erase(it);
 		}
+		free_record(amx);
 	}
 	amx_unregister_natives(amx);
 }
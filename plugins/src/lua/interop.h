@@ -4,10 +4,45 @@
 #include "lua/lualibs.h"
 #include "sdk/amx/amx.h"
 
+#include <memory>
+
+class amx_info;
+struct amx_public_info;
+struct amx_pubvar_info;
+struct amx_tag_info;
+
 namespace lua
 {
 	namespace interop
 	{
+		struct amx_record
+		{
+			std::weak_ptr<amx_info> info;
+			std::weak_ptr<amx_public_info> publics;
+			std::weak_ptr<amx_pubvar_info> pubvars;
+			std::weak_ptr<amx_tag_info> tags;
+		};
+
+		const long record_tag = AMX_USERTAG('Y', 'L', 'P', 'I');
+
+		extern size_t overflow_records;
+		amx_record *find_overflow_record(AMX *amx);
+
+		inline amx_record *get_record(AMX *amx)
+		{
+			for(int i = 0; i < AMX_USERNUM; i++)
+			{
+				if(amx->usertags[i] == record_tag)
+				{
+					return static_cast<amx_record*>(amx->userdata[i]);
+				}
+			}
+			return overflow_records ? find_overflow_record(amx) : nullptr;
+		}
+
+		amx_record &make_record(AMX *amx);
+		void free_record(AMX *amx);
+
 		int loader(lua_State *L);
 		void amx_unload(AMX *amx);
 		bool amx_get_addr(AMX *amx, cell amx_addr, cell **phys_addr);
@@ -0,0 +1,674 @@
+#include "layout.h"
+#include "lua_utils.h"
+#include "amx/amxutils.h"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+struct layout_field
+{
+	size_t offset;
+	size_t size;
+	// null for array fields, which are accessed through views
+	void (*get)(lua_State *L, cell *ptr, const layout_field &field);
+	void (*set)(lua_State *L, cell *ptr, const layout_field &field);
+};
+
+struct layout_info
+{
+	std::vector<layout_field> fields;
+	size_t size = 0;
+};
+
+struct record_info
+{
+	const layout_info *layout;
+	const lua::buffer_type *base;
+	ptrdiff_t offset;
+};
+
+struct record_array
+{
+	ptrdiff_t offset;
+	size_t count;
+	bool indirect;
+};
+
+static const char LAYOUTMTKEY = 0;
+
+static int layout_new(lua_State *L);
+static int layout_at(lua_State *L);
+static int layout_array(lua_State *L);
+static int layout_rows(lua_State *L);
+static int layout_offsetof(lua_State *L);
+
+namespace lua
+{
+	template <>
+	struct mt_ctor<layout_info>
+	{
+		bool operator()(lua_State *L)
+		{
+			if(lua_rawgetp(L, LUA_REGISTRYINDEX, &LAYOUTMTKEY) == LUA_TTABLE)
+			{
+				return true;
+			}
+			lua_pop(L, 1);
+
+			lua_createtable(L, 0, 4);
+			lua_pushvalue(L, -1);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, &LAYOUTMTKEY);
+
+			lua::pushliteral(L, "layout");
+			lua_setfield(L, -2, "__name");
+			lua_pushcfunction(L, [](lua_State *L)
+			{
+				lua_pushinteger(L, lua::touserdata<layout_info>(L, 1).size);
+				return 1;
+			});
+			lua_setfield(L, -2, "__len");
+
+			lua_createtable(L, 0, 5);
+			lua_pushcfunction(L, layout_new);
+			lua_setfield(L, -2, "new");
+			lua_pushcfunction(L, layout_at);
+			lua_setfield(L, -2, "at");
+			lua_pushcfunction(L, layout_array);
+			lua_setfield(L, -2, "array");
+			lua_pushcfunction(L, layout_rows);
+			lua_setfield(L, -2, "rows");
+			lua_pushcfunction(L, layout_offsetof);
+			lua_setfield(L, -2, "offsetof");
+			lua_setfield(L, -2, "__index");
+			return true;
+		}
+	};
+}
+
+static void get_integer(lua_State *L, cell *ptr, const layout_field &field)
+{
+	lua_pushinteger(L, *ptr);
+}
+
+static void set_integer(lua_State *L, cell *ptr, const layout_field &field)
+{
+	*ptr = (cell)luaL_checkinteger(L, 3);
+}
+
+static void get_floating(lua_State *L, cell *ptr, const layout_field &field)
+{
+	lua_pushnumber(L, amx_ctof(*ptr));
+}
+
+static void set_floating(lua_State *L, cell *ptr, const layout_field &field)
+{
+	float num = (float)luaL_checknumber(L, 3);
+	*ptr = amx_ftoc(num);
+}
+
+static void get_boolean(lua_State *L, cell *ptr, const layout_field &field)
+{
+	lua_pushboolean(L, *ptr);
+}
+
+static void set_boolean(lua_State *L, cell *ptr, const layout_field &field)
+{
+	*ptr = lua_toboolean(L, 3);
+}
+
+static void get_cell(lua_State *L, cell *ptr, const layout_field &field)
+{
+	lua_pushlightuserdata(L, reinterpret_cast<void*>(*ptr));
+}
+
+static void set_cell(lua_State *L, cell *ptr, const layout_field &field)
+{
+	if(lua_islightuserdata(L, 3))
+	{
+		*ptr = reinterpret_cast<cell>(lua_touserdata(L, 3));
+	}else{
+		*ptr = (cell)luaL_checkinteger(L, 3);
+	}
+}
+
+static void get_string(lua_State *L, cell *ptr, const layout_field &field)
+{
+	std::string str = amx::GetString(ptr, field.size, true);
+	lua_pushlstring(L, str.data(), str.size());
+}
+
+static void set_string(lua_State *L, cell *ptr, const layout_field &field)
+{
+	size_t len;
+	auto str = luaL_checklstring(L, 3, &len);
+	if(len >= field.size)
+	{
+		len = field.size - 1;
+	}
+	amx::SetString(ptr, str, len, false);
+}
+
+static bool parsetype(const char *type, layout_field &field)
+{
+	const char *bracket = std::strchr(type, '[');
+	size_t namelen = bracket ? bracket - type : std::strlen(type);
+	size_t count = 0;
+	if(bracket)
+	{
+		char *end;
+		long num = std::strtol(bracket + 1, &end, 10);
+		if(num <= 0 || end[0] != ']' || end[1] != '\0')
+		{
+			return false;
+		}
+		count = (size_t)num;
+	}
+
+	auto is = [&](const char *name)
+	{
+		return std::strlen(name) == namelen && std::strncmp(type, name, namelen) == 0;
+	};
+
+	if(is("string"))
+	{
+		if(!count) return false;
+		field.size = count;
+		field.get = get_string;
+		field.set = set_string;
+		return true;
+	}
+	if(is("int") || is("integer"))
+	{
+		field.get = get_integer;
+		field.set = set_integer;
+	}else if(is("float"))
+	{
+		field.get = get_floating;
+		field.set = set_floating;
+	}else if(is("bool"))
+	{
+		field.get = get_boolean;
+		field.set = set_boolean;
+	}else if(is("cell"))
+	{
+		field.get = get_cell;
+		field.set = set_cell;
+	}else{
+		return false;
+	}
+	if(count)
+	{
+		field.size = count;
+		field.get = nullptr;
+		field.set = nullptr;
+	}else{
+		field.size = 1;
+	}
+	return true;
+}
+
+static cell *getrecord(lua_State *L, int idx, const record_info &record, bool &isconst)
+{
+	size_t len;
+	lua_getuservalue(L, idx);
+	char *ptr;
+	if(record.base)
+	{
+		ptr = reinterpret_cast<char*>(record.base->get(L, lua_gettop(L), len, isconst));
+	}else{
+		ptr = reinterpret_cast<char*>(lua::tobuffer(L, -1, len, isconst));
+	}
+	lua_pop(L, 1);
+	auto offset = record.offset;
+	if(!ptr || offset < 0 || (size_t)offset + record.layout->size * sizeof(cell) > len)
+	{
+		luaL_error(L, "record is out of bounds of its buffer");
+		return nullptr;
+	}
+	return reinterpret_cast<cell*>(ptr + offset);
+}
+
+static const layout_field *getfield(lua_State *L, const layout_info &layout)
+{
+	if(lua_rawget(L, lua_upvalueindex(2)) != LUA_TNUMBER)
+	{
+		lua_pop(L, 1);
+		return nullptr;
+	}
+	auto index = (size_t)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return &layout.fields[index - 1];
+}
+
+static int record_index(lua_State *L)
+{
+	auto &layout = lua::touserdata<layout_info>(L, lua_upvalueindex(1));
+	auto &record = lua::touserdata<record_info>(L, 1);
+	lua_pushvalue(L, 2);
+	auto field = getfield(L, layout);
+	if(!field)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	bool isconst;
+	auto ptr = getrecord(L, 1, record, isconst) + field->offset;
+	if(field->get)
+	{
+		field->get(L, ptr, *field);
+		return 1;
+	}
+	lua_pushvalue(L, lua_upvalueindex(3));
+	lua_getuservalue(L, 1);
+	lua_pushlightuserdata(L, reinterpret_cast<void*>(record.offset + field->offset * sizeof(cell)));
+	lua_pushinteger(L, field->size);
+	lua_pushboolean(L, isconst);
+	lua_call(L, 4, 1);
+	return 1;
+}
+
+static int record_newindex(lua_State *L)
+{
+	auto &layout = lua::touserdata<layout_info>(L, lua_upvalueindex(1));
+	auto &record = lua::touserdata<record_info>(L, 1);
+	lua_pushvalue(L, 2);
+	auto field = getfield(L, layout);
+	if(!field)
+	{
+		return luaL_error(L, "record has no field '%s'", luaL_tolstring(L, 2, nullptr));
+	}
+	if(!field->set)
+	{
+		return luaL_error(L, "array field '%s' cannot be assigned", lua_tostring(L, 2));
+	}
+	bool isconst;
+	auto ptr = getrecord(L, 1, record, isconst) + field->offset;
+	if(isconst)
+	{
+		return luaL_error(L, "record is read-only");
+	}
+	field->set(L, ptr, *field);
+	return 0;
+}
+
+static void *record_get(lua_State *L, int idx, size_t &length, bool &isconst)
+{
+	auto &record = lua::touserdata<record_info>(L, idx);
+	length = record.layout->size * sizeof(cell);
+	return getrecord(L, idx, record, isconst);
+}
+
+static const lua::buffer_type record_buf = {record_get};
+
+static void pushrecord(lua_State *L, int layout, int base, ptrdiff_t offset)
+{
+	layout = lua_absindex(L, layout);
+	base = lua_absindex(L, base);
+	auto &record = lua::newuserdata<record_info>(L);
+	record.layout = &lua::touserdata<layout_info>(L, layout);
+	record.base = lua::getbuffertype(L, base);
+	record.offset = offset;
+	lua_pushvalue(L, base);
+	lua_setuservalue(L, -2);
+	lua_getuservalue(L, layout);
+	lua_rawgeti(L, -1, 1);
+	lua_setmetatable(L, -3);
+	lua_pop(L, 1);
+}
+
+static int array_index(lua_State *L)
+{
+	auto &layout = lua::touserdata<layout_info>(L, lua_upvalueindex(1));
+	auto &arr = lua::touserdata<record_array>(L, 1);
+	int isnum;
+	auto index = lua_tointegerx(L, 2, &isnum);
+	if(!isnum || index < 1 || (size_t)index > arr.count)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_getuservalue(L, 1);
+	ptrdiff_t offset;
+	if(arr.indirect)
+	{
+		size_t len;
+		bool isconst;
+		auto ptr = reinterpret_cast<char*>(lua::tobuffer(L, -1, len, isconst));
+		ptrdiff_t cellofs = arr.offset + (ptrdiff_t)(index - 1) * sizeof(cell);
+		if(!ptr || cellofs < 0 || (size_t)cellofs + sizeof(cell) > len)
+		{
+			return luaL_error(L, "record is out of bounds of its buffer");
+		}
+		offset = cellofs + *reinterpret_cast<cell*>(ptr + cellofs);
+	}else{
+		offset = arr.offset + (ptrdiff_t)(index - 1) * layout.size * sizeof(cell);
+	}
+	pushrecord(L, lua_upvalueindex(1), -1, offset);
+	return 1;
+}
+
+static int array_len(lua_State *L)
+{
+	lua_pushinteger(L, lua::touserdata<record_array>(L, 1).count);
+	return 1;
+}
+
+static void checkbase(lua_State *L, int idx, int info, size_t cells)
+{
+	idx = lua_absindex(L, idx);
+	if(lua_islightuserdata(L, idx))
+	{
+		lua_getfield(L, info, "view");
+		lua_pushvalue(L, idx);
+		lua_pushnil(L);
+		lua_pushinteger(L, cells);
+		lua_call(L, 3, 1);
+		lua_replace(L, idx);
+		return;
+	}
+	size_t len;
+	bool isconst;
+	if(!lua::tobuffer(L, idx, len, isconst))
+	{
+		lua::argerrortype(L, idx, "buffer type or light userdata");
+	}
+}
+
+static layout_info &checklayout(lua_State *L, int idx)
+{
+	if(lua_getmetatable(L, idx))
+	{
+		lua_rawgetp(L, LUA_REGISTRYINDEX, &LAYOUTMTKEY);
+		bool islayout = lua_rawequal(L, -2, -1);
+		lua_pop(L, 2);
+		if(islayout)
+		{
+			return lua::touserdata<layout_info>(L, idx);
+		}
+	}
+	lua::argerrortype(L, idx, "layout");
+	return lua::touserdata<layout_info>(L, idx);
+}
+
+static int layout_new(lua_State *L)
+{
+	auto &layout = checklayout(L, 1);
+	lua_Integer count = luaL_optinteger(L, 2, -1);
+	size_t cells = layout.size * (count < 0 ? 1 : (size_t)count);
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "newbuffer");
+	lua_pushinteger(L, cells);
+	lua_call(L, 1, 1);
+	if(count < 0)
+	{
+		pushrecord(L, 1, -1, 0);
+		return 1;
+	}
+	auto &arr = lua::newuserdata<record_array>(L);
+	arr.offset = 0;
+	arr.count = (size_t)count;
+	arr.indirect = false;
+	lua_insert(L, -2);
+	lua_setuservalue(L, -2);
+	lua_rawgeti(L, -2, 2);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int layout_at(lua_State *L)
+{
+	auto &layout = checklayout(L, 1);
+	lua_Integer index = luaL_optinteger(L, 3, 1);
+	if(index < 1)
+	{
+		return luaL_argerror(L, 3, "out of range");
+	}
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	checkbase(L, 2, 3, layout.size * (size_t)index);
+	pushrecord(L, 1, 2, (ptrdiff_t)(index - 1) * layout.size * sizeof(cell));
+	return 1;
+}
+
+template <bool Indirect>
+static int make_array(lua_State *L, layout_info &layout)
+{
+	lua_settop(L, 3);
+	lua_getuservalue(L, 1);
+	int info = lua_absindex(L, -1);
+	size_t count;
+	if(lua_isnoneornil(L, 3))
+	{
+		if(lua_islightuserdata(L, 2))
+		{
+			return luaL_argerror(L, 3, "count must be provided for AMX memory");
+		}
+		size_t len;
+		bool isconst;
+		auto ptr = reinterpret_cast<cell*>(lua::tobuffer(L, 2, len, isconst));
+		if(!ptr)
+		{
+			return lua::argerrortype(L, 2, "buffer type or light userdata");
+		}
+		if(Indirect)
+		{
+			count = len >= sizeof(cell) && *ptr > 0 ? (size_t)*ptr / sizeof(cell) : 0;
+		}else{
+			count = layout.size ? len / (layout.size * sizeof(cell)) : 0;
+		}
+	}else{
+		auto icount = luaL_checkinteger(L, 3);
+		if(icount < 0)
+		{
+			return luaL_argerror(L, 3, "out of range");
+		}
+		count = (size_t)icount;
+	}
+	if(lua_islightuserdata(L, 2))
+	{
+		lua_getfield(L, info, "view");
+		lua_pushvalue(L, 2);
+		lua_pushnil(L);
+		lua_pushinteger(L, Indirect ? count * (1 + layout.size) : count * layout.size);
+		lua_call(L, 3, 1);
+		lua_replace(L, 2);
+	}else{
+		size_t len;
+		bool isconst;
+		if(!lua::tobuffer(L, 2, len, isconst))
+		{
+			return lua::argerrortype(L, 2, "buffer type or light userdata");
+		}
+	}
+	auto &arr = lua::newuserdata<record_array>(L);
+	arr.offset = 0;
+	arr.count = count;
+	arr.indirect = Indirect;
+	lua_pushvalue(L, 2);
+	lua_setuservalue(L, -2);
+	lua_rawgeti(L, info, 2);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int layout_array(lua_State *L)
+{
+	return make_array<false>(L, checklayout(L, 1));
+}
+
+static int layout_rows(lua_State *L)
+{
+	return make_array<true>(L, checklayout(L, 1));
+}
+
+static int layout_offsetof(lua_State *L)
+{
+	checklayout(L, 1);
+	luaL_checkstring(L, 2);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, 3);
+	lua_pushvalue(L, 2);
+	if(lua_rawget(L, -2) != LUA_TNUMBER)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	auto &layout = lua::touserdata<layout_info>(L, 1);
+	lua_pushinteger(L, layout.fields[(size_t)lua_tointeger(L, -1) - 1].offset + 1);
+	return 1;
+}
+
+static void addfield(lua_State *L, layout_info &layout, int fields, int name, int type)
+{
+	name = lua_absindex(L, name);
+	type = lua_absindex(L, type);
+	if(!lua::isstring(L, name))
+	{
+		luaL_error(L, "field name must be a string");
+		return;
+	}
+	layout_field field;
+	auto typestr = lua_tostring(L, type);
+	if(!typestr || !parsetype(typestr, field))
+	{
+		luaL_error(L, "invalid type of field '%s'", lua_tostring(L, name));
+		return;
+	}
+	lua_pushvalue(L, name);
+	if(lua_rawget(L, fields) != LUA_TNIL)
+	{
+		luaL_error(L, "duplicate field '%s'", lua_tostring(L, name));
+		return;
+	}
+	lua_pop(L, 1);
+	field.offset = layout.size;
+	layout.size += field.size;
+	layout.fields.push_back(field);
+	lua_pushvalue(L, name);
+	lua_pushinteger(L, layout.fields.size());
+	lua_rawset(L, fields);
+}
+
+static int newlayout(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	auto &layout = lua::newuserdata<layout_info>(L);
+	int self = lua_absindex(L, -1);
+
+	lua_createtable(L, 3, 2);
+	int info = lua_absindex(L, -1);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setfield(L, info, "view");
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_setfield(L, info, "newbuffer");
+
+	lua_newtable(L);
+	int fields = lua_absindex(L, -1);
+
+	auto len = luaL_len(L, 1);
+	for(lua_Integer i = 1; i <= len; i++)
+	{
+		switch(lua_rawgeti(L, 1, i))
+		{
+			case LUA_TSTRING:
+			{
+				auto spec = lua_tostring(L, -1);
+				auto colon = std::strchr(spec, ':');
+				if(!colon)
+				{
+					return luaL_error(L, "field %d must be in the form 'name:type'", (int)i);
+				}
+				lua_pushlstring(L, spec, colon - spec);
+				lua_pushstring(L, colon + 1);
+				addfield(L, layout, fields, -2, -1);
+				lua_pop(L, 2);
+				break;
+			}
+			case LUA_TTABLE:
+				lua_rawgeti(L, -1, 1);
+				lua_rawgeti(L, -2, 2);
+				addfield(L, layout, fields, -2, -1);
+				lua_pop(L, 2);
+				break;
+			default:
+				return luaL_error(L, "field %d must be a string or a {name, type} pair", (int)i);
+		}
+		lua_pop(L, 1);
+	}
+
+	// hash keys have no defined order, so named fields follow the sequence sorted by name
+	std::vector<std::string> names;
+	lua_pushnil(L);
+	while(lua_next(L, 1))
+	{
+		if(lua_type(L, -2) == LUA_TSTRING)
+		{
+			size_t namelen;
+			auto name = lua_tolstring(L, -2, &namelen);
+			names.emplace_back(name, namelen);
+		}
+		lua_pop(L, 1);
+	}
+	std::sort(names.begin(), names.end());
+	for(const auto &name : names)
+	{
+		lua_pushlstring(L, name.data(), name.size());
+		lua_pushvalue(L, -1);
+		lua_rawget(L, 1);
+		addfield(L, layout, fields, -2, -1);
+		lua_pop(L, 2);
+	}
+
+	lua_createtable(L, 0, 5);
+	lua::pushliteral(L, "record");
+	lua_setfield(L, -2, "__name");
+	lua_pushboolean(L, false);
+	lua_setfield(L, -2, "__metatable");
+	lua_pushvalue(L, self);
+	lua_pushvalue(L, fields);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushcclosure(L, record_index, 3);
+	lua_setfield(L, -2, "__index");
+	lua_pushvalue(L, self);
+	lua_pushvalue(L, fields);
+	lua_pushcclosure(L, record_newindex, 2);
+	lua_setfield(L, -2, "__newindex");
+	lua::setbuffertype(L, -1, record_buf);
+	lua_rawseti(L, info, 1);
+
+	lua_createtable(L, 0, 4);
+	lua::pushliteral(L, "records");
+	lua_setfield(L, -2, "__name");
+	lua_pushboolean(L, false);
+	lua_setfield(L, -2, "__metatable");
+	lua_pushvalue(L, self);
+	lua_pushcclosure(L, array_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, array_len);
+	lua_setfield(L, -2, "__len");
+	lua_rawseti(L, info, 2);
+
+	lua_pushvalue(L, fields);
+	lua_rawseti(L, info, 3);
+
+	lua_pushvalue(L, info);
+	lua_setuservalue(L, self);
+
+	lua_settop(L, self);
+	return 1;
+}
+
+void lua::interop::init_layout(lua_State *L, AMX *)
+{
+	int table = lua_absindex(L, -1);
+
+	lua_getfield(L, table, "view");
+	lua_getfield(L, table, "newbuffer");
+	lua_pushcclosure(L, newlayout, 2);
+	lua_setfield(L, table, "layout");
+}
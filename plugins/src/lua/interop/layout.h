@@ -0,0 +1,15 @@
+#ifndef LAYOUT_H_INCLUDED
+#define LAYOUT_H_INCLUDED
+
+#include "lua/lualibs.h"
+#include "sdk/amx/amx.h"
+
+namespace lua
+{
+	namespace interop
+	{
+		void init_layout(lua_State *L, AMX *amx);
+	}
+}
+
+#endif
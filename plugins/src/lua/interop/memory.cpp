@@ -153,33 +153,37 @@ int buffer_newindex(lua_State *L)
 	return 0;
 }
 
-int buffer_buf(lua_State *L)
+void *buffer_get(lua_State *L, int idx, size_t &length, bool &isconst)
 {
-	lua_pushlightuserdata(L, lua_touserdata(L, 1));
-	lua_pushinteger(L, lua_rawlen(L, 1));
-	lua_pushvalue(L, lua_upvalueindex(1));
-	return 3;
+	length = lua_rawlen(L, idx);
+	isconst = false;
+	return lua_touserdata(L, idx);
+}
+
+void *cbuffer_get(lua_State *L, int idx, size_t &length, bool &isconst)
+{
+	length = lua_rawlen(L, idx);
+	isconst = true;
+	return lua_touserdata(L, idx);
 }
 
-int heap_buf(lua_State *L)
+void *heap_get(lua_State *L, int idx, size_t &length, bool &isconst)
 {
-	auto amx = lua::touserdata<AMX*>(L, 1);
+	auto amx = lua::touserdata<AMX*>(L, idx);
 	auto hdr = (AMX_HEADER*)amx->base;
 	auto data = (amx->data != NULL) ? amx->data : amx->base + (int)hdr->dat;
-	lua_pushlightuserdata(L, data + amx->hlw);
-	lua_pushinteger(L, amx->hea - amx->hlw);
-	lua_pushboolean(L, true);
-	return 3;
+	length = amx->hea - amx->hlw;
+	isconst = false;
+	return data + amx->hlw;
 }
 
-int span_buf(lua_State *L)
+void *span_get(lua_State *L, int idx, size_t &length, bool &isconst)
 {
-	if(lua_getmetatable(L, 1))
+	if(lua_getmetatable(L, idx))
 	{
 		int mt = lua_absindex(L, -1);
 
 		size_t len;
-		bool isconst;
 		lua_getfield(L, mt, "__base");
 		if(auto ptr = reinterpret_cast<char*>(lua::tobuffer(L, -1, len, isconst)))
 		{
@@ -210,16 +214,19 @@ int span_buf(lua_State *L)
 
 			lua_pop(L, 1);
 
-			lua_pushlightuserdata(L, ptr);
-			lua_pushinteger(L, len);
-			lua_pushboolean(L, !isconst);
-			return 3;
+			length = len;
+			return ptr;
 		}
 		lua_pop(L, 2);
 	}
-	return 0;
+	return nullptr;
 }
 
+static const lua::buffer_type buffer_buf = {buffer_get};
+static const lua::buffer_type cbuffer_buf = {cbuffer_get};
+static const lua::buffer_type heap_buf = {heap_get};
+static const lua::buffer_type span_buf = {span_get};
+
 int span(lua_State *L)
 {
 	size_t blen;
@@ -257,8 +264,7 @@ int span(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	lua_pushcfunction(L, buffer_newindex);
 	lua_setfield(L, -2, "__newindex");
-	lua_pushcfunction(L, span_buf);
-	lua_setfield(L, -2, "__buf");
+	lua::setbuffertype(L, -1, span_buf);
 
 	lua_pushvalue(L, 1);
 	lua_setfield(L, -2, "__base");
@@ -577,9 +583,7 @@ void lua::interop::init_memory(lua_State *L, AMX *amx)
 	lua_setfield(L, -2, "__index");
 	lua_pushcfunction(L, buffer_newindex);
 	lua_setfield(L, -2, "__newindex");
-	lua_pushboolean(L, true);
-	lua_pushcclosure(L, buffer_buf, 1);
-	lua_setfield(L, -2, "__buf");
+	lua::setbuffertype(L, -1, buffer_buf);
 
 	int buffer = lua_absindex(L, -1);
 
@@ -594,9 +598,7 @@ void lua::interop::init_memory(lua_State *L, AMX *amx)
 	lua_setfield(L, -2, "__index");
 	lua_pushcfunction(L, buffer_newindex);
 	lua_setfield(L, -2, "__newindex");
-	lua_pushboolean(L, false);
-	lua_pushcclosure(L, buffer_buf, 1);
-	lua_setfield(L, -2, "__buf");
+	lua::setbuffertype(L, -1, cbuffer_buf);
 
 	int cbuffer = lua_absindex(L, -1);
 
@@ -630,8 +632,7 @@ void lua::interop::init_memory(lua_State *L, AMX *amx)
 	lua_setfield(L, -2, "__index");
 	lua_pushcfunction(L, buffer_newindex);
 	lua_setfield(L, -2, "__newindex");
-	lua_pushcfunction(L, heap_buf);
-	lua_setfield(L, -2, "__buf");
+	lua::setbuffertype(L, -1, heap_buf);
 
 	lua_setmetatable(L, -2);
 	lua_setfield(L, table, "heap");
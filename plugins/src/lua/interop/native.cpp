@@ -1,6 +1,7 @@
 #include "native.h"
 #include "lua_utils.h"
 #include "amx/amxutils.h"
+#include "lua/interop.h"
 
 #include <unordered_map>
 #include <unordered_set>
@@ -446,7 +447,7 @@ void lua::interop::amx_register_natives(AMX *amx, const AMX_NATIVE_INFO *nativel
 
 bool lua::interop::amx_get_param_addr(AMX *amx, cell amx_addr, cell **phys_addr)
 {
-	if(phys_addr && addr_set.find(amx_addr) != addr_set.end())
+	if(phys_addr && !addr_set.empty() && lua::interop::get_record(amx) && addr_set.find(amx_addr) != addr_set.end())
 	{
 		auto hdr = (AMX_HEADER*)amx->base;
 		auto data = (amx->data != NULL) ? amx->data : amx->base + (int)hdr->dat;
@@ -1,14 +1,14 @@
 #include "public.h"
 #include "lua_utils.h"
+#include "lua/interop.h"
 #include "lua_api.h"
 #include "sleep.h"
+#include "lua/budget.h"
 
-#include <unordered_map>
 #include <memory>
 #include <cstring>
 #include <limits>
-
-static std::unordered_map<AMX*, std::weak_ptr<struct amx_public_info>> amx_map;
+#include <vector>
 
 struct amx_public_info
 {
@@ -18,29 +18,159 @@ struct amx_public_info
 	int self;
 	int publictable;
 	int publiclist;
-	int contlist;
+
+	struct continuation
+	{
+		int ref = LUA_NOREF;
+		cell generation = 0;
+	};
+	std::vector<continuation> conts;
+	std::vector<size_t> free_conts;
 
 	amx_public_info(lua_State *L, AMX *amx) : L(L), amx(amx)
 	{
 
 	}
 
-	~amx_public_info()
+	void suspend(int ref)
+	{
+		size_t slot;
+		if(free_conts.empty())
+		{
+			slot = conts.size();
+			conts.emplace_back();
+		}else{
+			slot = free_conts.back();
+			free_conts.pop_back();
+		}
+		auto &cont = conts[slot];
+		cont.ref = ref;
+		cont.generation++;
+		amx->cip = (cell)(slot + 1);
+		amx->alt = cont.generation;
+	}
+
+	int resume()
 	{
-		if(amx)
+		size_t slot = (size_t)(ucell)amx->cip - 1;
+		if(slot < conts.size())
 		{
-			amx_map.erase(amx);
-			amx = nullptr;
+			auto &cont = conts[slot];
+			if(cont.ref != LUA_NOREF && cont.generation == amx->alt)
+			{
+				int tt = lua_rawgeti(L, LUA_REGISTRYINDEX, cont.ref);
+				luaL_unref(L, LUA_REGISTRYINDEX, cont.ref);
+				cont.ref = LUA_NOREF;
+				free_conts.push_back(slot);
+				return tt;
+			}
 		}
+		lua_pushnil(L);
+		return LUA_TNIL;
 	}
 };
 
+static int await_dispatch(lua_State *L)
+{
+	auto n = lua_rawlen(L, lua_upvalueindex(1));
+	if(n > 0)
+	{
+		lua_rawgeti(L, lua_upvalueindex(1), 1);
+		for(lua_Integer i = 1; i < (lua_Integer)n; i++)
+		{
+			lua_rawgeti(L, lua_upvalueindex(1), i + 1);
+			lua_rawseti(L, lua_upvalueindex(1), i);
+		}
+		lua_pushnil(L);
+		lua_rawseti(L, lua_upvalueindex(1), n);
+		lua_insert(L, 1);
+		lua_call(L, lua_gettop(L) - 1, 0);
+		return 0;
+	}
+	if(!lua_isnil(L, lua_upvalueindex(2)))
+	{
+		lua_pushvalue(L, lua_upvalueindex(2));
+		lua_insert(L, 1);
+		return lua::tailcall(L, lua_gettop(L) - 1);
+	}
+	return 0;
+}
+
+static int await_register(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	const char *name = luaL_checkstring(L, 2);
+	bool current = false;
+	if(lua_getfield(L, lua_upvalueindex(2), name) == LUA_TFUNCTION)
+	{
+		lua_getfield(L, lua_upvalueindex(1), name);
+		current = lua_rawequal(L, -1, -2);
+		lua_pop(L, 1);
+		lua_getupvalue(L, -1, 1);
+		lua_remove(L, -2);
+	}else{
+		lua_pop(L, 1);
+		lua_newtable(L);
+	}
+	if(!current)
+	{
+		// put a dispatcher in front of the current handler, keeping queued waiters
+		lua_pushvalue(L, -1);
+		lua_getfield(L, lua_upvalueindex(1), name);
+		lua_pushcclosure(L, await_dispatch, 2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, lua_upvalueindex(2), name);
+		lua_setfield(L, lua_upvalueindex(1), name);
+	}
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+	return 0;
+}
+
+static bool isfailure(lua_State *L, int idx)
+{
+	switch(lua_type(L, idx))
+	{
+		case LUA_TNIL:
+			return true;
+		case LUA_TBOOLEAN:
+			return !lua_toboolean(L, idx);
+		case LUA_TNUMBER:
+			return lua_tonumber(L, idx) == 0;
+		case LUA_TLIGHTUSERDATA:
+			return lua_touserdata(L, idx) == nullptr;
+	}
+	return false;
+}
+
+static int await(lua_State *L)
+{
+	if(!lua_isyieldable(L)) return luaL_error(L, "must be executed inside 'async'");
+	int top = lua_gettop(L);
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	if(top < 2 || lua_type(L, top) != LUA_TSTRING)
+	{
+		return lua::argerrortype(L, top < 2 ? 2 : top, "string");
+	}
+	lua_pushvalue(L, top);
+	lua_insert(L, 1);
+	lua_call(L, top - 1, 1);
+	if(isfailure(L, -1))
+	{
+		return 1;
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	return lua::tailyield(L, 2);
+}
+
 void lua::interop::init_public(lua_State *L, AMX *amx)
 {
 	int table = lua_absindex(L, -1);
 
 	auto info = std::make_shared<amx_public_info>(lua::mainthread(L), amx);
-	amx_map[amx] = info;
+	lua::interop::make_record(amx).publics = info;
 	lua::pushuserdata(L, info);
 
 	lua_getfield(L, table, "public");
@@ -49,10 +179,13 @@ void lua::interop::init_public(lua_State *L, AMX *amx)
 	lua_newtable(L);
 	info->publiclist = luaL_ref(L, LUA_REGISTRYINDEX);
 
-	lua_newtable(L);
-	info->contlist = luaL_ref(L, LUA_REGISTRYINDEX);
-
 	info->self = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	lua_getfield(L, table, "public");
+	lua_newtable(L);
+	lua_pushcclosure(L, await_register, 2);
+	lua_pushcclosure(L, await, 1);
+	lua_setfield(L, table, "await");
 }
 
 bool getpublic(lua_State *L, const char *name, int index, int &error)
@@ -91,10 +224,10 @@ bool lua::interop::amx_find_public(AMX *amx, const char *funcname, int *index, i
 {
 	if(index)
 	{
-		auto it = amx_map.find(amx);
-		if(it != amx_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(record)
 		{
-			if(auto info = it->second.lock())
+			if(auto info = record->publics.lock())
 			{
 				auto L = info->L;
 				lua::stackguard guard(L);
@@ -171,10 +304,10 @@ bool lua::interop::amx_get_public(AMX *amx, int index, char *funcname)
 {
 	if(funcname)
 	{
-		auto it = amx_map.find(amx);
-		if(it != amx_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(record)
 		{
-			if(auto info = it->second.lock())
+			if(auto info = record->publics.lock())
 			{
 				auto L = info->L;
 				lua::stackguard guard(L);
@@ -207,10 +340,10 @@ bool lua::interop::amx_num_publics(AMX *amx, int *number)
 {
 	if(number)
 	{
-		auto it = amx_map.find(amx);
-		if(it != amx_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(record)
 		{
-			if(auto info = it->second.lock())
+			if(auto info = record->publics.lock())
 			{
 				auto L = info->L;
 				lua::stackguard guard(L);
@@ -232,10 +365,10 @@ bool lua::interop::amx_num_publics(AMX *amx, int *number)
 
 bool lua::interop::amx_exec(AMX *amx, cell *retval, int index, int &result)
 {
-	auto it = amx_map.find(amx);
-	if(it != amx_map.end())
+	auto record = lua::interop::get_record(amx);
+	if(record)
 	{
-		if(auto info = it->second.lock())
+		if(auto info = record->publics.lock())
 		{
 			auto L = info->L;
 			lua::stackguard guard(L);
@@ -247,31 +380,12 @@ bool lua::interop::amx_exec(AMX *amx, cell *retval, int index, int &result)
 			bool cont = index == AMX_EXEC_CONT;
 			if(cont || getpubliclist(L, info->publiclist))
 			{
-				int tt = cont ? lua_rawgeti(L, LUA_REGISTRYINDEX, info->contlist) : lua_rawgeti(L, -1, index + 1);
+				int tt = cont ? LUA_TTABLE : lua_rawgeti(L, -1, index + 1);
 				if(tt == LUA_TTABLE)
 				{
 					if(cont)
 					{
-						tt = lua_rawgeti(L, -1, amx->cip);
-						if(tt == LUA_TTABLE)
-						{
-							tt = lua_rawgeti(L, -1, 1);
-							if(tt == LUA_TFUNCTION)
-							{
-								lua_rawgeti(L, -2, 2);
-								auto cookie = lua_tointeger(L, -1);
-								lua_pop(L, 1);
-								if(amx->alt != cookie)
-								{
-									tt = LUA_TNIL;
-								}else{
-									luaL_unref(L, -3, amx->cip);
-								}
-								lua_remove(L, -2);
-							}
-						}else{
-							tt = LUA_TNIL;
-						}
+						tt = info->resume();
 					}else{
 						tt = lua_rawgeti(L, -1, 1);
 					}
@@ -302,7 +416,7 @@ bool lua::interop::amx_exec(AMX *amx, cell *retval, int index, int &result)
 							amx->frm = amx->stk;
 						}
 
-						int error = lua_pcall(L, paramcount, 1, 0);
+						int error = lua::budget::pcall(L, paramcount, 1);
 						if(error == LUA_OK)
 						{
 							amx->cip = 0;
@@ -352,7 +466,11 @@ bool lua::interop::amx_exec(AMX *amx, cell *retval, int index, int &result)
 											amx->error = (int)lua_tointeger(L, -1);
 										}
 										lua_pop(L, 1);
-										lua::interop::handle_sleep(L, amx, info->contlist);
+										int ref = lua::interop::handle_sleep(L, amx);
+										if(ref != LUA_NOREF)
+										{
+											info->suspend(ref);
+										}
 									}
 									break;
 								default:
@@ -370,13 +488,13 @@ bool lua::interop::amx_exec(AMX *amx, cell *retval, int index, int &result)
 							lua_pop(L, 1);
 						}
 						amx->stk = reset_stk;
-						lua_pop(L, cont ? 1 : 2);
+						lua_pop(L, cont ? 0 : 2);
 						result = amx->error;
 						return true;
 					}
 					lua_pop(L, 1);
 				}
-				lua_pop(L, cont ? 1 : 2);
+				lua_pop(L, cont ? 0 : 2);
 			}
 			if(cont)
 			{
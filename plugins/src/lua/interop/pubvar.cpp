@@ -1,13 +1,22 @@
 #include "pubvar.h"
 #include "lua_utils.h"
+#include "lua/interop.h"
 #include "lua_api.h"
 
 #include <unordered_map>
+#include <vector>
+#include <string>
 #include <memory>
+#include <algorithm>
 #include <cstring>
 
-static std::unordered_map<AMX*, std::weak_ptr<struct amx_pubvar_info>> amx_map;
-static std::unordered_map<cell, std::weak_ptr<cell>> addr_map;
+struct pubvar_entry
+{
+	int index = 0;
+	cell addr = 0;
+	bool valid = false;
+	bool stable = false;
+};
 
 struct amx_pubvar_info
 {
@@ -18,18 +27,35 @@ struct amx_pubvar_info
 	int pubvartable;
 	int pubvarlist;
 
-	amx_pubvar_info(lua_State *L, AMX *amx) : L(L), amx(amx)
+	std::unordered_map<std::string, pubvar_entry> pubvars;
+	std::vector<cell> addrs;
+
+	void add_addr(cell addr)
 	{
+		addrs.insert(std::upper_bound(addrs.begin(), addrs.end(), addr), addr);
+	}
 
+	void remove_addr(cell addr)
+	{
+		auto it = std::lower_bound(addrs.begin(), addrs.end(), addr);
+		if(it != addrs.end() && *it == addr)
+		{
+			addrs.erase(it);
+		}
 	}
 
-	~amx_pubvar_info()
+	bool has_addr(cell addr) const
 	{
-		if(amx)
+		if(addrs.empty() || addr < addrs.front() || addr > addrs.back())
 		{
-			amx_map.erase(amx);
-			amx = nullptr;
+			return false;
 		}
+		return std::binary_search(addrs.begin(), addrs.end(), addr);
+	}
+
+	amx_pubvar_info(lua_State *L, AMX *amx) : L(L), amx(amx)
+	{
+
 	}
 };
 
@@ -38,7 +64,7 @@ void lua::interop::init_pubvar(lua_State *L, AMX *amx)
 	int table = lua_absindex(L, -1);
 
 	auto info = std::make_shared<amx_pubvar_info>(lua::mainthread(L), amx);
-	amx_map[amx] = info;
+	lua::interop::make_record(amx).pubvars = info;
 	lua::pushuserdata(L, info);
 
 	lua_getfield(L, table, "public");
@@ -84,30 +110,58 @@ bool getpubvarlist(lua_State *L, int index)
 	return false;
 }
 
+static bool cachedpubvar(lua_State *L, amx_pubvar_info &info, const char *name, const pubvar_entry &entry)
+{
+	if(lua_rawgeti(L, -1, entry.index) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		return false;
+	}
+	lua_rawgeti(L, -1, 1);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, info.pubvartable);
+	bool hit = false;
+	if(lua_istable(L, -1))
+	{
+		lua_pushstring(L, name);
+		lua_rawget(L, -2);
+		hit = lua_rawequal(L, -1, -3);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 3);
+	return hit;
+}
+
 bool lua::interop::amx_find_pubvar(AMX *amx, const char *varname, cell *amx_addr, int &error)
 {
 	if(amx_addr)
 	{
-		auto it = amx_map.find(amx);
-		if(it != amx_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(record)
 		{
-			if(auto info = it->second.lock())
+			if(auto info = record->pubvars.lock())
 			{
 				auto L = info->L;
 				lua::stackguard guard(L);
-				if(!lua_checkstack(L, 4))
+				if(!lua_checkstack(L, 5))
 				{
 					error = AMX_ERR_MEMORY;
 					return true;
 				}
 				if(getpubvarlist(L, info->pubvarlist))
 				{
-					int index = 0;
-					if(lua_getfield(L, -1, varname) == LUA_TNUMBER)
+					auto &entry = info->pubvars[varname];
+					if(entry.valid && entry.stable && cachedpubvar(L, *info, varname, entry))
 					{
-						index = (int)lua_tointeger(L, -1);
+						lua_pop(L, 1);
+						*amx_addr = entry.addr;
+						error = AMX_ERR_NONE;
+						return true;
+					}
+					if(entry.valid)
+					{
+						info->remove_addr(entry.addr);
+						entry.valid = false;
 					}
-					lua_pop(L, 1);
 					int lerror;
 					void *buf;
 					if(getpubvar(L, varname, info->pubvartable, lerror, buf))
@@ -115,49 +169,40 @@ bool lua::interop::amx_find_pubvar(AMX *amx, const char *varname, cell *amx_addr
 						auto hdr = (AMX_HEADER*)amx->base;
 						auto data = (amx->data != NULL) ? amx->data : amx->base + (int)hdr->dat;
 						cell addr = *amx_addr = reinterpret_cast<unsigned char*>(buf) - data;
-						auto lock = addr_map[addr].lock();
-						if(!lock)
+						entry.addr = addr;
+						entry.valid = true;
+						entry.stable = lua_type(L, -1) == LUA_TUSERDATA;
+						info->add_addr(addr);
+						if(entry.index && lua_rawgeti(L, -2, entry.index) == LUA_TTABLE)
 						{
-							lock = std::make_shared<cell>(addr);
-							addr_map[addr] = lock;
-						}
-						if(index)
-						{
-							if(lua_rawgeti(L, -2, index) == LUA_TTABLE)
+							lua_insert(L, -2);
+							lua_rawseti(L, -2, 1);
+						}else{
+							if(entry.index)
 							{
-								lua_insert(L, -2);
-								lua_rawseti(L, -2, 1);
-								lua::pushuserdata(L, std::move(lock));
-								lua_rawseti(L, -2, 3);
-								lua_pop(L, 2);
-								error = AMX_ERR_NONE;
-								return true;
+								lua_pop(L, 1);
 							}
-							lua_pop(L, 1);
-						}else{
 							lua_createtable(L, 3, 0);
 							lua_insert(L, -2);
 							lua_rawseti(L, -2, 1);
 							lua_pushstring(L, varname);
 							lua_rawseti(L, -2, 2);
-							lua::pushuserdata(L, std::move(lock));
-							lua_rawseti(L, -2, 3);
-							int index = luaL_ref(L, -2);
-							lua_pushinteger(L, index);
-							lua_setfield(L, -2, varname);
-							lua_pop(L, 1);
-							error = AMX_ERR_NONE;
-							return true;
+							lua_pushvalue(L, -1);
+							entry.index = luaL_ref(L, -3);
 						}
-						lua_pop(L, 1);
+						lua_pushinteger(L, addr);
+						lua_rawseti(L, -2, 3);
+						lua_pop(L, 2);
+						error = AMX_ERR_NONE;
+						return true;
 					}else if(lerror != LUA_OK)
 					{
 						error = AMX_ERR_GENERAL;
 						return true;
 					}
-					if(index)
+					if(entry.index)
 					{
-						if(lua_rawgeti(L, -1, index) == LUA_TTABLE)
+						if(lua_rawgeti(L, -1, entry.index) == LUA_TTABLE)
 						{
 							lua_pushnil(L);
 							lua_rawseti(L, -2, 1);
@@ -165,6 +210,8 @@ bool lua::interop::amx_find_pubvar(AMX *amx, const char *varname, cell *amx_addr
 							lua_rawseti(L, -2, 3);
 						}
 						lua_pop(L, 1);
+					}else{
+						info->pubvars.erase(varname);
 					}
 					lua_pop(L, 1);
 				}
@@ -180,10 +227,10 @@ bool lua::interop::amx_get_pubvar(AMX *amx, int index, char *varname, cell *amx_
 {
 	if(varname || amx_addr)
 	{
-		auto it = amx_map.find(amx);
-		if(it != amx_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(record)
 		{
-			if(auto info = it->second.lock())
+			if(auto info = record->pubvars.lock())
 			{
 				auto L = info->L;
 				lua::stackguard guard(L);
@@ -197,9 +244,9 @@ bool lua::interop::amx_get_pubvar(AMX *amx, int index, char *varname, cell *amx_
 					{
 						if(amx_addr)
 						{
-							if(lua_rawgeti(L, -1, 3) == LUA_TUSERDATA)
+							if(lua_rawgeti(L, -1, 3) == LUA_TNUMBER)
 							{
-								*amx_addr = *lua::touserdata<std::shared_ptr<cell>>(L, -1);
+								*amx_addr = (cell)lua_tointeger(L, -1);
 							}
 							lua_pop(L, 1);
 						}
@@ -211,8 +258,8 @@ bool lua::interop::amx_get_pubvar(AMX *amx, int index, char *varname, cell *amx_
 								std::strcpy(varname, str);
 							}
 							lua_pop(L, 1);
-							lua_pop(L, 2);
 						}
+						lua_pop(L, 2);
 						return true;
 					}
 					lua_pop(L, 2);
@@ -227,10 +274,10 @@ bool lua::interop::amx_num_pubvars(AMX *amx, int *number)
 {
 	if(number)
 	{
-		auto it = amx_map.find(amx);
-		if(it != amx_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(record)
 		{
-			if(auto info = it->second.lock())
+			if(auto info = record->pubvars.lock())
 			{
 				auto L = info->L;
 				lua::stackguard guard(L);
@@ -254,16 +301,14 @@ bool lua::interop::amx_get_pubvar_addr(AMX *amx, cell amx_addr, cell **phys_addr
 {
 	if(phys_addr)
 	{
-		auto it = addr_map.find(amx_addr);
-		if(it != addr_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(!record)
+		{
+			return false;
+		}
+		auto info = record->pubvars.lock();
+		if(info && info->has_addr(amx_addr))
 		{
-			auto lock = it->second.lock();
-			if(!lock)
-			{
-				addr_map.erase(it);
-				return false;
-			}
-
 			auto hdr = (AMX_HEADER*)amx->base;
 			auto data = (amx->data != NULL) ? amx->data : amx->base + (int)hdr->dat;
 			*phys_addr = reinterpret_cast<cell*>(data + amx_addr);
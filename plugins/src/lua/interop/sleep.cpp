@@ -2,8 +2,6 @@
 #include "lua_utils.h"
 #include "amx/amxutils.h"
 
-#include <cstdlib>
-
 int sleep(lua_State *L)
 {
 	luaL_checktype(L, 1, LUA_TFUNCTION);
@@ -58,7 +56,7 @@ void lua::interop::init_sleep(lua_State *L, AMX *amx)
 	lua_setfield(L, table, "sleep");
 }
 
-void lua::interop::handle_sleep(lua_State *L, AMX *amx, int contlist)
+int lua::interop::handle_sleep(lua_State *L, AMX *amx)
 {
 	if(lua_getfield(L, -1, "__retval") == LUA_TLIGHTUSERDATA)
 	{
@@ -66,21 +64,10 @@ void lua::interop::handle_sleep(lua_State *L, AMX *amx, int contlist)
 	}
 	lua_pop(L, 1);
 
-	if(lua_rawgeti(L, LUA_REGISTRYINDEX, contlist) == LUA_TTABLE)
+	if(lua_getfield(L, -1, "__cont") == LUA_TFUNCTION)
 	{
-		if(lua_getfield(L, -2, "__cont") == LUA_TFUNCTION)
-		{
-			lua_createtable(L, 2, 0);
-			lua_insert(L, -2);
-			lua_rawseti(L, -2, 1);
-			int cookie = std::rand();
-			lua_pushinteger(L, cookie);
-			lua_rawseti(L, -2, 2);
-			amx->alt = cookie;
-			amx->cip = luaL_ref(L, -2);
-		}else{
-			lua_pop(L, 1);
-		}
+		return luaL_ref(L, LUA_REGISTRYINDEX);
 	}
 	lua_pop(L, 1);
+	return LUA_NOREF;
 }
@@ -9,7 +9,7 @@ namespace lua
 	namespace interop
 	{
 		void init_sleep(lua_State *L, AMX *amx);
-		void handle_sleep(lua_State *L, AMX *amx, int contlist);
+		int handle_sleep(lua_State *L, AMX *amx);
 	}
 }
 
@@ -1,12 +1,11 @@
 #include "tags.h"
 #include "lua_utils.h"
+#include "lua/interop.h"
 
 #include <unordered_map>
 #include <memory>
 #include <cstring>
 
-static std::unordered_map<AMX*, std::weak_ptr<struct amx_tag_info>> amx_map;
-
 struct amx_tag_info
 {
 	AMX *amx;
@@ -19,15 +18,6 @@ struct amx_tag_info
 	{
 
 	}
-
-	~amx_tag_info()
-	{
-		if(amx)
-		{
-			amx_map.erase(amx);
-			amx = nullptr;
-		}
-	}
 };
 
 static bool getudatatag(lua_State *L, int idx, const char *&tagname)
@@ -183,7 +173,7 @@ void lua::interop::init_tags(lua_State *L, AMX *amx, const std::unordered_map<ce
 	int table = lua_absindex(L, -1);
 
 	auto info = std::make_shared<amx_tag_info>(lua::mainthread(L), amx);
-	amx_map[amx] = info;
+	lua::interop::make_record(amx).tags = info;
 	lua::pushuserdata(L, info);
 
 	luaL_checkstack(L, init.size() + 4, nullptr);
@@ -229,10 +219,10 @@ bool lua::interop::amx_find_tag_id(AMX *amx, cell tag_id, char *tagname)
 {
 	if(tagname && (tag_id & 0x80000000) == 0 && tag_id != 0)
 	{
-		auto it = amx_map.find(amx);
-		if(it != amx_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(record)
 		{
-			if(auto info = it->second.lock())
+			if(auto info = record->tags.lock())
 			{
 				auto L = info->L;
 				lua::stackguard guard(L);
@@ -265,10 +255,10 @@ bool lua::interop::amx_get_tag(AMX *amx, int index, char *tagname, cell *tag_id)
 {
 	if(tagname || tag_id)
 	{
-		auto it = amx_map.find(amx);
-		if(it != amx_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(record)
 		{
-			if(auto info = it->second.lock())
+			if(auto info = record->tags.lock())
 			{
 				auto L = info->L;
 				lua::stackguard guard(L);
@@ -305,10 +295,10 @@ bool lua::interop::amx_num_tags(AMX *amx, int *number)
 {
 	if(number)
 	{
-		auto it = amx_map.find(amx);
-		if(it != amx_map.end())
+		auto record = lua::interop::get_record(amx);
+		if(record)
 		{
-			if(auto info = it->second.lock())
+			if(auto info = record->tags.lock())
 			{
 				auto L = info->L;
 				lua::stackguard guard(L);
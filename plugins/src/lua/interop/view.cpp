@@ -0,0 +1,392 @@
+#include "view.h"
+#include "lua_utils.h"
+#include "amx/amxutils.h"
+
+#include <algorithm>
+#include <cstring>
+
+struct view_info
+{
+	AMX *amx = nullptr;
+	cell addr = 0;
+	ptrdiff_t offset = 0;
+	lua_Integer length = -1;
+	bool isconst = false;
+};
+
+static const char VIEWMTKEY = 0;
+
+namespace lua
+{
+	template <>
+	struct mt_ctor<view_info>
+	{
+		bool operator()(lua_State *L)
+		{
+			if(lua_rawgetp(L, LUA_REGISTRYINDEX, &VIEWMTKEY) == LUA_TTABLE)
+			{
+				return true;
+			}
+			lua_pop(L, 1);
+			return false;
+		}
+	};
+}
+
+static bool isview(lua_State *L, int idx)
+{
+	if(lua_getmetatable(L, idx))
+	{
+		lua_rawgetp(L, LUA_REGISTRYINDEX, &VIEWMTKEY);
+		bool isview = lua_rawequal(L, -2, -1);
+		lua_pop(L, 2);
+		return isview;
+	}
+	return false;
+}
+
+static cell *getview(lua_State *L, int idx, size_t &length, bool &isconst)
+{
+	idx = lua_absindex(L, idx);
+	if(!isview(L, idx))
+	{
+		lua::argerrortype(L, idx, "view");
+		return nullptr;
+	}
+	auto &view = lua::touserdata<view_info>(L, idx);
+	char *ptr;
+	if(view.amx)
+	{
+		auto amx = view.amx;
+		if(view.addr < 0 || view.addr >= amx->stp)
+		{
+			length = 0;
+			isconst = view.isconst;
+			return nullptr;
+		}
+		auto hdr = (AMX_HEADER*)amx->base;
+		auto data = (amx->data != NULL) ? amx->data : amx->base + (int)hdr->dat;
+		ptr = reinterpret_cast<char*>(data + view.addr);
+		length = (size_t)(amx->stp - view.addr);
+		isconst = false;
+	}else{
+		lua_getuservalue(L, idx);
+		ptr = reinterpret_cast<char*>(lua::tobuffer(L, -1, length, isconst));
+		lua_pop(L, 1);
+		if(!ptr)
+		{
+			length = 0;
+			return nullptr;
+		}
+		if(view.offset > (ptrdiff_t)length)
+		{
+			ptr += length;
+			length = 0;
+		}else{
+			ptr += view.offset;
+			length -= view.offset;
+		}
+	}
+	if(view.length >= 0 && (size_t)view.length < length)
+	{
+		length = (size_t)view.length;
+	}
+	length /= sizeof(cell);
+	if(view.isconst) isconst = true;
+	return reinterpret_cast<cell*>(ptr);
+}
+
+static bool tocell(lua_State *L, int idx, cell &value)
+{
+	if(lua_isinteger(L, idx))
+	{
+		value = (cell)lua_tointeger(L, idx);
+	}else if(lua::isnumber(L, idx))
+	{
+		float num = (float)lua_tonumber(L, idx);
+		value = amx_ftoc(num);
+	}else if(lua_isboolean(L, idx))
+	{
+		value = (cell)lua_toboolean(L, idx);
+	}else if(lua_islightuserdata(L, idx))
+	{
+		value = reinterpret_cast<cell>(lua_touserdata(L, idx));
+	}else{
+		return false;
+	}
+	return true;
+}
+
+static bool checkrange(lua_State *L, int arg, size_t length, size_t &first, size_t &count)
+{
+	lua_Integer i = luaL_optinteger(L, arg, 1);
+	lua_Integer j = luaL_optinteger(L, arg + 1, (lua_Integer)length);
+	if(i < 1) i = 1;
+	if(j > (lua_Integer)length) j = (lua_Integer)length;
+	if(i > j)
+	{
+		first = count = 0;
+		return false;
+	}
+	first = (size_t)(i - 1);
+	count = (size_t)(j - i + 1);
+	return true;
+}
+
+static int view_ints(lua_State *L)
+{
+	size_t length, first, count;
+	bool isconst;
+	auto ptr = getview(L, 1, length, isconst);
+	if(!checkrange(L, 2, length, first, count))
+	{
+		return 0;
+	}
+	luaL_checkstack(L, (int)count, "too many results");
+	ptr += first;
+	for(size_t i = 0; i < count; i++)
+	{
+		lua_pushinteger(L, ptr[i]);
+	}
+	return (int)count;
+}
+
+static int view_floats(lua_State *L)
+{
+	size_t length, first, count;
+	bool isconst;
+	auto ptr = getview(L, 1, length, isconst);
+	if(!checkrange(L, 2, length, first, count))
+	{
+		return 0;
+	}
+	luaL_checkstack(L, (int)count, "too many results");
+	ptr += first;
+	for(size_t i = 0; i < count; i++)
+	{
+		lua_pushnumber(L, amx_ctof(ptr[i]));
+	}
+	return (int)count;
+}
+
+static int view_set(lua_State *L)
+{
+	size_t length;
+	bool isconst;
+	auto ptr = getview(L, 1, length, isconst);
+	if(isconst)
+	{
+		return luaL_error(L, "view is read-only");
+	}
+	lua_Integer index = luaL_checkinteger(L, 2);
+	if(index < 1)
+	{
+		return luaL_argerror(L, 2, "out of range");
+	}
+	int top = lua_gettop(L);
+	size_t written = 0;
+	for(int i = 3; i <= top && (size_t)index + written <= length; i++)
+	{
+		cell value;
+		if(!tocell(L, i, value))
+		{
+			return lua::argerrortype(L, i, "primitive type");
+		}
+		ptr[index - 1 + written++] = value;
+	}
+	lua_pushinteger(L, written);
+	return 1;
+}
+
+static int view_fill(lua_State *L)
+{
+	size_t length, first, count;
+	bool isconst;
+	auto ptr = getview(L, 1, length, isconst);
+	cell value;
+	if(!tocell(L, 2, value))
+	{
+		return lua::argerrortype(L, 2, "primitive type");
+	}
+	if(isconst)
+	{
+		return luaL_error(L, "view is read-only");
+	}
+	if(checkrange(L, 3, length, first, count))
+	{
+		std::fill_n(ptr + first, count, value);
+	}
+	return 0;
+}
+
+static int view_copy(lua_State *L)
+{
+	size_t length, first, count;
+	bool isconst;
+	auto ptr = getview(L, 1, length, isconst);
+
+	size_t dlen;
+	bool dconst;
+	auto dest = reinterpret_cast<cell*>(lua::tobuffer(L, 2, dlen, dconst));
+	if(!dest)
+	{
+		return lua::argerrortype(L, 2, "buffer type");
+	}
+	if(dconst)
+	{
+		return luaL_argerror(L, 2, "buffer is read-only");
+	}
+	dlen /= sizeof(cell);
+	lua_Integer index = luaL_optinteger(L, 3, 1);
+	if(index < 1)
+	{
+		return luaL_argerror(L, 3, "out of range");
+	}
+	if(!checkrange(L, 4, length, first, count) || (size_t)index > dlen)
+	{
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	if(count > dlen - (size_t)(index - 1))
+	{
+		count = dlen - (size_t)(index - 1);
+	}
+	std::memmove(dest + (index - 1), ptr + first, count * sizeof(cell));
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+static int view_find(lua_State *L)
+{
+	size_t length;
+	bool isconst;
+	auto ptr = getview(L, 1, length, isconst);
+	cell value;
+	if(!tocell(L, 2, value))
+	{
+		return lua::argerrortype(L, 2, "primitive type");
+	}
+	lua_Integer init = luaL_optinteger(L, 3, 1);
+	if(init < 1) init = 1;
+	if((size_t)init <= length)
+	{
+		auto end = ptr + length;
+		auto it = std::find(ptr + (init - 1), end, value);
+		if(it != end)
+		{
+			lua_pushinteger(L, it - ptr + 1);
+			return 1;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static int view_len(lua_State *L)
+{
+	size_t length;
+	bool isconst;
+	getview(L, 1, length, isconst);
+	lua_pushinteger(L, length);
+	return 1;
+}
+
+static void *view_get(lua_State *L, int idx, size_t &length, bool &isconst)
+{
+	auto ptr = getview(L, idx, length, isconst);
+	length *= sizeof(cell);
+	return ptr;
+}
+
+static const lua::buffer_type view_buf = {view_get};
+
+static int view(lua_State *L)
+{
+	auto amx = reinterpret_cast<AMX*>(lua_touserdata(L, lua_upvalueindex(1)));
+	ptrdiff_t offset = lua::checkoffset(L, 2);
+	lua_Integer len = -1;
+	bool isconst = !!lua_toboolean(L, 4);
+	if(lua_islightuserdata(L, 1))
+	{
+		len = luaL_checkinteger(L, 3);
+		if(len < 0)
+		{
+			return luaL_argerror(L, 3, "out of range");
+		}
+		auto &view = lua::newuserdata<view_info>(L);
+		view.amx = amx;
+		view.addr = reinterpret_cast<cell>(lua_touserdata(L, 1)) + (cell)offset;
+		view.length = len * sizeof(cell);
+		view.isconst = isconst;
+		return 1;
+	}
+
+	size_t blen;
+	bool bconst;
+	if(!lua::tobuffer(L, 1, blen, bconst))
+	{
+		return lua::argerrortype(L, 1, "buffer type or light userdata");
+	}
+	if(!lua_isnoneornil(L, 3))
+	{
+		len = luaL_checkinteger(L, 3);
+		if(len < 0)
+		{
+			return luaL_argerror(L, 3, "out of range");
+		}
+		len *= sizeof(cell);
+	}
+	if(offset < 0)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	auto &view = lua::newuserdata<view_info>(L);
+	view.offset = offset;
+	view.length = len;
+	view.isconst = isconst;
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+void lua::interop::init_view(lua_State *L, AMX *amx)
+{
+	int table = lua_absindex(L, -1);
+
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &VIEWMTKEY) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 5);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &VIEWMTKEY);
+
+		lua::pushliteral(L, "view");
+		lua_setfield(L, -2, "__name");
+		lua_pushboolean(L, false);
+		lua_setfield(L, -2, "__metatable");
+		lua_pushcfunction(L, view_len);
+		lua_setfield(L, -2, "__len");
+		lua::setbuffertype(L, -1, view_buf);
+
+		lua_createtable(L, 0, 6);
+		lua_pushcfunction(L, view_ints);
+		lua_setfield(L, -2, "ints");
+		lua_pushcfunction(L, view_floats);
+		lua_setfield(L, -2, "floats");
+		lua_pushcfunction(L, view_set);
+		lua_setfield(L, -2, "set");
+		lua_pushcfunction(L, view_fill);
+		lua_setfield(L, -2, "fill");
+		lua_pushcfunction(L, view_copy);
+		lua_setfield(L, -2, "copy");
+		lua_pushcfunction(L, view_find);
+		lua_setfield(L, -2, "find");
+		lua_setfield(L, -2, "__index");
+	}
+	lua_pop(L, 1);
+
+	lua_pushlightuserdata(L, amx);
+	lua_pushcclosure(L, view, 1);
+	lua_setfield(L, table, "view");
+}
@@ -0,0 +1,15 @@
+#ifndef VIEW_H_INCLUDED
+#define VIEW_H_INCLUDED
+
+#include "lua/lualibs.h"
+#include "sdk/amx/amx.h"
+
+namespace lua
+{
+	namespace interop
+	{
+		void init_view(lua_State *L, AMX *amx);
+	}
+}
+
+#endif
@@ -1,20 +1,35 @@
 #include "timer.h"
 #include "lua_utils.h"
 #include "lua_api.h"
+#include "budget.h"
 
 #include <utility>
 #include <chrono>
 #include <list>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <map>
 
 typedef std::function<void()> handler_t;
 
+struct task
+{
+	int priority;
+	handler_t handler;
+};
+
+static const char *const priorities[] = {"high", "normal", "low", nullptr};
+static const int num_priorities = 3;
+
 static int tick_count = 0;
-static std::list<std::pair<int, handler_t>> tick_handlers;
-static std::list<std::pair<std::chrono::steady_clock::time_point, handler_t>> timer_handlers;
+static std::list<std::pair<int, task>> tick_handlers;
+static std::list<std::pair<std::chrono::steady_clock::time_point, task>> timer_handlers;
+static std::deque<handler_t> run_queue[num_priorities];
+static int run_budget = 2000;
 
 template <class Ord, class Obj>
 typename std::list<std::pair<Ord, Obj>>::iterator insert_sorted(std::list<std::pair<Ord, Obj>> &list, const Ord &ord, Obj &&obj)
@@ -28,70 +43,127 @@ typename std::list<std::pair<Ord, Obj>>::iterator insert_sorted(std::list<std::p
 	}
 }
 
-static void register_tick(int ticks, handler_t &&handler)
+static void register_tick(lua_Integer ticks, int priority, handler_t &&handler)
 {
-	int time = tick_count + ticks;
-	insert_sorted(tick_handlers, time, std::move(handler));
+	int time = tick_count + (int)ticks;
+	insert_sorted(tick_handlers, time, task{priority, std::move(handler)});
 }
 
-static void register_timer(int interval, handler_t &&handler)
+static void register_timer(lua_Integer interval, int priority, handler_t &&handler)
 {
 	auto time = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::milliseconds(interval));
-	insert_sorted(timer_handlers, time, std::move(handler));
+	insert_sorted(timer_handlers, time, task{priority, std::move(handler)});
 }
 
-void lua::timer::tick()
+static void register_deadline(lua_Integer deadline, int priority, handler_t &&handler)
 {
-	tick_count++;
+	std::chrono::steady_clock::time_point time{std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::microseconds(deadline))};
+	insert_sorted(timer_handlers, time, task{priority, std::move(handler)});
+}
+
+template <class Ord>
+static void enqueue_due(std::list<std::pair<Ord, task>> &list, const Ord &now)
+{
+	auto it = list.begin();
+	while(it != list.end() && !(now < it->first))
 	{
-		auto it = tick_handlers.begin();
-		while(it != tick_handlers.end())
-		{
-			auto &pair = *it;
+		auto &task = it->second;
+		run_queue[task.priority].push_back(std::move(task.handler));
+		it = list.erase(it);
+	}
+}
 
-			if(pair.first <= tick_count)
-			{
-				auto handler = std::move(pair.second);
-				it = tick_handlers.erase(it);
-				handler();
-			}else{
-				break;
-			}
+static bool run_next()
+{
+	for(auto &queue : run_queue)
+	{
+		if(!queue.empty())
+		{
+			auto handler = std::move(queue.front());
+			queue.pop_front();
+			handler();
+			return true;
 		}
 	}
+	return false;
+}
+
+void lua::timer::tick()
+{
+	tick_count++;
+	enqueue_due(tick_handlers, tick_count);
 	if(tick_handlers.empty())
 	{
 		tick_count = 0;
 	}
+	enqueue_due(timer_handlers, std::chrono::steady_clock::now());
 
-	auto now = std::chrono::steady_clock::now();
+	// continuations that do not fit in the budget are resumed on the next tick, in the same order
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(run_budget);
+	while(run_next())
 	{
-		auto it = timer_handlers.begin();
-		while(it != timer_handlers.end())
+		if(run_budget > 0 && std::chrono::steady_clock::now() >= deadline)
 		{
-			auto &pair = *it;
-
-			if(pair.first <= now)
-			{
-				auto handler = std::move(pair.second);
-				it = timer_handlers.erase(it);
-				handler();
-			}else{
-				break;
-			}
+			break;
 		}
 	}
 }
 
+int lua::timer::budget(int usec)
+{
+	int old = run_budget;
+	if(usec >= 0)
+	{
+		run_budget = usec;
+	}
+	return old;
+}
+
+static void close_watchdog();
+
 void lua::timer::close()
 {
+	close_watchdog();
 	tick_handlers.clear();
 	timer_handlers.clear();
+	for(auto &queue : run_queue)
+	{
+		queue.clear();
+	}
 }
 
-template <void (*Register)(int interval, handler_t &&handler)>
+static const char PRIORITYKEY = 0;
+
+static void pushthread(lua_State *L, lua_State *thread)
+{
+	if(!lua_checkstack(thread, 1))
+	{
+		luaL_error(L, "stack overflow");
+	}
+	lua_pushthread(thread);
+	lua_xmove(thread, L, 1);
+}
+
+static int getpriority(lua_State *L)
+{
+	int priority = 1;
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &PRIORITYKEY) == LUA_TTABLE)
+	{
+		lua_pushthread(L);
+		if(lua_rawget(L, -2) == LUA_TNUMBER)
+		{
+			priority = (int)lua_tointeger(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return priority;
+}
+
+template <void (*Register)(lua_Integer interval, int priority, handler_t &&handler)>
 static int settimer(lua_State *L)
 {
+	int priority = lua_isinteger(L, lua_upvalueindex(2)) ? (int)lua_tointeger(L, lua_upvalueindex(2)) : getpriority(L);
 	luaL_checktype(L, 1, LUA_TFUNCTION);
 	auto interval = luaL_checkinteger(L, 2);
 	lua_remove(L, 2);
@@ -109,7 +181,7 @@ static int settimer(lua_State *L)
 
 	std::weak_ptr<char> handle = lua::touserdata<std::shared_ptr<char>>(L, lua_upvalueindex(1));
 	L = lua::mainthread(L);
-	Register((int)interval, [=]()
+	Register(interval, priority, [=]()
 	{
 		if(auto lock = handle.lock())
 		{
@@ -117,7 +189,7 @@ static int settimer(lua_State *L)
 			luaL_checkstack(L, 2, nullptr);
 			lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
 			luaL_unref(L, LUA_REGISTRYINDEX, ref);
-			int err = lua_pcall(L, 0, 0, 0);
+			int err = lua::budget::pcall(L, 0, 0);
 			if(err != LUA_OK)
 			{
 				lua::report_error(L, err);
@@ -130,10 +202,76 @@ static int settimer(lua_State *L)
 }
 
 static const char HOOKKEY = 0;
+static const char PREEMPTKEY = 0;
+static const char NEXTTICKKEY = 0;
+
+void lua::timer::preemptible(lua_State *L, lua_State *thread)
+{
+	luaL_checkstack(L, 4, nullptr);
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &NEXTTICKKEY) != LUA_TFUNCTION)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &PREEMPTKEY) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 2);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &PREEMPTKEY);
+		lua::pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_pushvalue(L, -1);
+		lua_setmetatable(L, -2);
+	}
+	pushthread(L, thread);
+	lua_pushboolean(L, false);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+bool lua::timer::preempt(lua_State *L)
+{
+	if(!lua_isyieldable(L) || !lua_checkstack(L, 4))
+	{
+		return false;
+	}
+	bool ok = false;
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &PREEMPTKEY) == LUA_TTABLE)
+	{
+		lua_pushthread(L);
+		if(lua_rawget(L, -2) == LUA_TBOOLEAN)
+		{
+			lua_pushthread(L);
+			lua_pushboolean(L, true);
+			lua_rawset(L, -4);
+			ok = true;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return ok;
+}
 
 bool lua::timer::pushyielded(lua_State *L, lua_State *from)
 {
 	luaL_checkstack(L, 4, nullptr);
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &PREEMPTKEY) == LUA_TTABLE)
+	{
+		pushthread(L, from);
+		if(lua_rawget(L, -2) == LUA_TBOOLEAN && lua_toboolean(L, -1))
+		{
+			pushthread(L, from);
+			lua_pushboolean(L, false);
+			lua_rawset(L, -4);
+			lua_pop(L, 2);
+			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEXTTICKKEY);
+			return true;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
 	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &HOOKKEY) == LUA_TTABLE)
 	{
 		if(!lua_checkstack(from, 1))
@@ -155,7 +293,7 @@ bool lua::timer::pushyielded(lua_State *L, lua_State *from)
 static int parallelex(lua_State *L)
 {
 	if(!lua_isyieldable(L)) return luaL_error(L, "must be executed inside 'async'");
-	if(lua_gethook(L)) return luaL_error(L, "the thread must not have any hooks");
+	if(lua_gethook(L) && !lua::budget::ishook(lua_gethook(L))) return luaL_error(L, "the thread must not have any hooks");
 
 	int count = static_cast<int>(luaL_checkinteger(L, 1));
 	if(count <= 0)
@@ -195,6 +333,7 @@ static int parallelex(lua_State *L)
 	lua_KFunction cont = [](lua_State *L, int status, lua_KContext ctx)
 	{
 		lua_sethook(L, nullptr, 0, 0);
+		lua::budget::install(L);
 		lua_rawgetp(L, LUA_REGISTRYINDEX, &HOOKKEY);
 		lua_pushthread(L);
 		lua_pushnil(L);
@@ -231,30 +370,59 @@ static int parallel(lua_State *L)
 static int sleep(lua_State *L)
 {
 	auto interval = luaL_checkinteger(L, 1);
-	auto duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::milliseconds(interval));
-	
-	auto end = std::chrono::steady_clock::now() + duration;
-	lua_pushvalue(L, lua_upvalueindex(1));
-	lua::pushcfunction(L, [=](lua_State *L)
-	{
-		if(std::chrono::steady_clock::now() >= end)
-		{
-			lua_pushboolean(L, true);
-			return 1;
-		}
-		std::this_thread::yield();
-		return 0;
-	});
-	return lua::tailcall(L, 1);
+	if(!lua_isyieldable(L)) return luaL_error(L, "must be executed inside 'async'");
+
+	auto end = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::milliseconds(interval));
+	lua_settop(L, 0);
+	lua_pushvalue(L, lua_upvalueindex(1 + getpriority(L)));
+	lua_pushinteger(L, std::chrono::duration_cast<std::chrono::microseconds>(end.time_since_epoch()).count());
+	return lua::tailyield(L, 2);
 }
 
 static int wait(lua_State *L)
 {
-	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, lua_upvalueindex(1 + getpriority(L)));
 	lua_insert(L, 1);
 	return lua::tailyield(L, lua_gettop(L));
 }
 
+void lua::timer::resetthread(lua_State *L, lua_State *thread)
+{
+	luaL_checkstack(L, 3, nullptr);
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &PRIORITYKEY) == LUA_TTABLE)
+	{
+		pushthread(L, thread);
+		lua_pushnil(L);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 1);
+}
+
+static int priority(lua_State *L)
+{
+	int old = getpriority(L);
+	if(!lua_isnoneornil(L, 1))
+	{
+		int priority = luaL_checkoption(L, 1, nullptr, priorities);
+		if(lua_rawgetp(L, LUA_REGISTRYINDEX, &PRIORITYKEY) != LUA_TTABLE)
+		{
+			lua_pop(L, 1);
+			lua_createtable(L, 0, 2);
+			lua_pushvalue(L, -1);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, &PRIORITYKEY);
+			lua::pushliteral(L, "k");
+			lua_setfield(L, -2, "__mode");
+			lua_pushvalue(L, -1);
+			lua_setmetatable(L, -2);
+		}
+		lua_pushthread(L);
+		lua_pushinteger(L, priority);
+		lua_rawset(L, -3);
+	}
+	lua_pushstring(L, priorities[old]);
+	return 1;
+}
+
 static void timeout_hook(lua_State *L, lua_Debug *ar)
 {
 	if(ar->event == LUA_HOOKCOUNT)
@@ -272,6 +440,90 @@ static void timeout_hook(lua_State *L, lua_Debug *ar)
 	}
 }
 
+struct watch
+{
+	lua_State *L;
+	bool fired = false;
+};
+
+typedef std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<watch>> watch_map;
+
+static std::mutex watchdog_mutex;
+static std::condition_variable watchdog_cv;
+static watch_map watchdog_deadlines;
+static std::thread watchdog_thread;
+static bool watchdog_exit = false;
+
+static void watchdog()
+{
+	std::unique_lock<std::mutex> lock(watchdog_mutex);
+	while(!watchdog_exit)
+	{
+		if(watchdog_deadlines.empty())
+		{
+			watchdog_cv.wait(lock);
+			continue;
+		}
+		auto it = watchdog_deadlines.begin();
+		if(std::chrono::steady_clock::now() < it->first)
+		{
+			watchdog_cv.wait_until(lock, it->first);
+			continue;
+		}
+		it->second->fired = true;
+		lua_sethook(it->second->L, timeout_hook, LUA_MASKCOUNT, 1);
+		watchdog_deadlines.erase(it);
+	}
+}
+
+static watch_map::iterator watchdog_arm(const std::shared_ptr<watch> &info, std::chrono::steady_clock::duration duration)
+{
+	std::lock_guard<std::mutex> lock(watchdog_mutex);
+	if(!watchdog_thread.joinable())
+	{
+		watchdog_thread = std::thread(watchdog);
+	}
+	auto it = watchdog_deadlines.emplace(std::chrono::steady_clock::now() + duration, info);
+	if(it == watchdog_deadlines.begin())
+	{
+		watchdog_cv.notify_one();
+	}
+	return it;
+}
+
+static void watchdog_disarm(lua_State *L, const std::shared_ptr<watch> &info, watch_map::iterator it)
+{
+	std::lock_guard<std::mutex> lock(watchdog_mutex);
+	if(!info->fired)
+	{
+		watchdog_deadlines.erase(it);
+	}
+	if(lua_gethook(L) == timeout_hook)
+	{
+		lua_sethook(L, nullptr, 0, 0);
+		lua::budget::install(L);
+	}
+}
+
+static void close_watchdog()
+{
+	{
+		std::lock_guard<std::mutex> lock(watchdog_mutex);
+		watchdog_exit = true;
+		for(auto &pair : watchdog_deadlines)
+		{
+			pair.second->fired = true;
+		}
+		watchdog_deadlines.clear();
+		watchdog_cv.notify_one();
+	}
+	if(watchdog_thread.joinable())
+	{
+		watchdog_thread.join();
+	}
+	watchdog_exit = false;
+}
+
 static int timeout(lua_State *L)
 {
 	auto duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::milliseconds(luaL_checkinteger(L, 1)));
@@ -282,14 +534,6 @@ static int timeout(lua_State *L)
 		return lua::argerrortype(L, 1, "function or thread");
 	}
 
-	struct signal
-	{
-		bool ended = false;
-		std::mutex hook_mutex;
-	};
-
-	auto info = std::make_shared<signal>();
-
 	lua_State *lthread;
 	if(lua_isthread(L, 1))
 	{
@@ -298,32 +542,21 @@ static int timeout(lua_State *L)
 		lthread = L;
 	}
 
-	std::thread([=]()
-	{
-		std::this_thread::sleep_for(duration);
-		
-		std::lock_guard<std::mutex> lock(info->hook_mutex);
-		if(!info->ended)
-		{
-			lua_sethook(lthread, timeout_hook, LUA_MASKCOUNT, 1);
-		}
-	}).detach();
+	auto info = std::make_shared<watch>();
+	info->L = lthread;
+	auto it = watchdog_arm(info, duration);
 
 	if(lua_isthread(L, 1))
 	{
 		int nargs = lua_gettop(L) - 1;
 		if(!lua_checkstack(lthread, nargs))
 		{
+			watchdog_disarm(lthread, info, it);
 			return luaL_error(L, "stack overflow");
 		}
 		lua_xmove(L, lthread, nargs);
 		int status = lua_resume(lthread, L, nargs);
-		std::lock_guard<std::mutex> lock(info->hook_mutex);
-		info->ended = true;
-		if(lua_gethook(lthread) == timeout_hook)
-		{
-			lua_sethook(lthread, nullptr, 0, 0);
-		}
+		watchdog_disarm(lthread, info, it);
 		switch(status)
 		{
 			case LUA_OK:
@@ -339,12 +572,7 @@ static int timeout(lua_State *L)
 	}else{
 		return lua::pcallk(L, lua_gettop(L) - 1, lua::numresults(L), 0, [=](lua_State *L, int status)
 		{
-			std::lock_guard<std::mutex> lock(info->hook_mutex);
-			info->ended = true;
-			if(lua_gethook(L) == timeout_hook)
-			{
-				lua_sethook(L, nullptr, 0, 0);
-			}
+			watchdog_disarm(L, info, it);
 			switch(status)
 			{
 				case LUA_OK:
@@ -369,7 +597,7 @@ int lua::timer::loader(lua_State *L)
 	lua_pushvalue(L, -1);
 	lua_pushcclosure(L, settimer<register_tick>, 1);
 	lua_setfield(L, table, "tick");
-	luaL_ref(L, LUA_REGISTRYINDEX);
+	int handle = luaL_ref(L, LUA_REGISTRYINDEX);
 
 	lua_pushcfunction(L, parallelex);
 	lua_setfield(L, table, "parallelex");
@@ -384,21 +612,41 @@ int lua::timer::loader(lua_State *L)
 		lua_pushinteger(L, 1);
 		return lua::tailcall(L, lua_gettop(L) - 1);
 	}, 1);
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &NEXTTICKKEY);
 	lua_pushcclosure(L, parallel, 2);
 	lua_setfield(L, table, "parallel");
 
-	lua::loadbufferx(L, "local f=...;while not f() do end", "='sleep'", nullptr);
-	lua_pushcclosure(L, sleep, 1);
+	for(int i = 0; i < num_priorities; i++)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, handle);
+		lua_pushinteger(L, i);
+		lua_pushcclosure(L, settimer<register_deadline>, 2);
+	}
+	lua_pushcclosure(L, sleep, num_priorities);
 	lua_setfield(L, table, "sleep");
 
-	lua_getfield(L, table, "ms");
-	lua_pushcclosure(L, wait, 1);
+	for(int i = 0; i < num_priorities; i++)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, handle);
+		lua_pushinteger(L, i);
+		lua_pushcclosure(L, settimer<register_timer>, 2);
+	}
+	lua_pushcclosure(L, wait, num_priorities);
 	lua_setfield(L, table, "wait");
 
-	lua_getfield(L, table, "tick");
-	lua_pushcclosure(L, wait, 1);
+	for(int i = 0; i < num_priorities; i++)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, handle);
+		lua_pushinteger(L, i);
+		lua_pushcclosure(L, settimer<register_tick>, 2);
+	}
+	lua_pushcclosure(L, wait, num_priorities);
 	lua_setfield(L, table, "waitticks");
 
+	lua_pushcfunction(L, priority);
+	lua_setfield(L, table, "priority");
+
 	lua_pushcfunction(L, timeout);
 	lua_setfield(L, table, "timeout");
 
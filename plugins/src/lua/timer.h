@@ -10,7 +10,11 @@ namespace lua
 		int loader(lua_State *L);
 		void close();
 		void tick();
+		int budget(int usec);
 		bool pushyielded(lua_State *L, lua_State *from);
+		void preemptible(lua_State *L, lua_State *thread);
+		bool preempt(lua_State *L);
+		void resetthread(lua_State *L, lua_State *thread);
 	}
 }
 
@@ -1,8 +1,14 @@
 #include "lua_api.h"
 #include "lua_utils.h"
+#include "lua_adapt.h"
 #include "lua/timer.h"
+#include "lua/gc.h"
+#include "lua/budget.h"
+#include "lua/ldo.h"
 #include "lua/interop.h"
 #include "lua/remote.h"
+#include "lua/channel.h"
+#include "lua/clone.h"
 #include "main.h"
 
 #include <vector>
@@ -82,14 +88,106 @@ static int table_copy(lua_State *L)
 	return 0;
 }
 
+static const char POOLKEY = 0;
+static const char EXPOSEDKEY = 0;
+static const int pool_size = 32;
+
+static void expose(lua_State *L)
+{
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &EXPOSEDKEY) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 2);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &EXPOSEDKEY);
+		lua::pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_pushvalue(L, -1);
+		lua_setmetatable(L, -2);
+	}
+	lua_pushthread(L);
+	lua_pushboolean(L, true);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+static bool exposed(lua_State *L, int idx)
+{
+	idx = lua_absindex(L, idx);
+	bool result = false;
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &EXPOSEDKEY) == LUA_TTABLE)
+	{
+		lua_pushvalue(L, idx);
+		result = lua_rawget(L, -2) != LUA_TNIL;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return result;
+}
+
+static void newthread(lua_State *L)
+{
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &POOLKEY) == LUA_TTABLE)
+	{
+		auto n = lua_rawlen(L, -1);
+		if(n > 0)
+		{
+			lua_rawgeti(L, -1, n);
+			lua_pushnil(L);
+			lua_rawseti(L, -3, n);
+			lua_remove(L, -2);
+			return;
+		}
+	}
+	lua_pop(L, 1);
+	auto thread = lua_newthread(L);
+	if(lua::budget::limited(L))
+	{
+		lua::timer::preemptible(L, thread);
+	}
+}
+
+static void recycle(lua_State *L, int idx)
+{
+	idx = lua_absindex(L, idx);
+	auto thread = lua_tothread(L, idx);
+	if(exposed(L, idx))
+	{
+		// user code may still hold the thread; reusing it would alias an unrelated task
+		return;
+	}
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &POOLKEY) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, pool_size, 0);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &POOLKEY);
+	}
+	auto n = lua_rawlen(L, -1);
+	if(n < pool_size)
+	{
+		lua_sethook(thread, nullptr, 0, 0);
+		lua::budget::install(thread);
+		lua::timer::resetthread(L, thread);
+		luaD_shrinkstack(thread);
+		lua_pushvalue(L, idx);
+		lua_rawseti(L, -2, n + 1);
+	}
+	lua_pop(L, 1);
+}
+
 static int async(lua_State *L)
 {
 	luaL_checktype(L, 1, LUA_TFUNCTION);
-	lua_newthread(L);
+	newthread(L);
 	lua_pushnil(L);
 	lua_pushcclosure(L, [](lua_State *L)
 	{
 		auto thread = lua_tothread(L, lua_upvalueindex(1));
+		if(!thread)
+		{
+			return luaL_error(L, "cannot resume dead coroutine");
+		}
 		int num = lua_gettop(L);
 		if(!lua_checkstack(thread, num))
 		{
@@ -104,8 +202,11 @@ static int async(lua_State *L)
 		{
 			case LUA_OK:
 				num = lua_gettop(thread);
-				luaL_checkstack(L, num, nullptr);
+				luaL_checkstack(L, num + 2, nullptr);
 				lua_xmove(thread, L, num);
+				recycle(L, lua_upvalueindex(1));
+				lua_pushnil(L);
+				lua_replace(L, lua_upvalueindex(1));
 				return num;
 			case LUA_YIELD:
 				num = lua_gettop(thread);
@@ -388,6 +489,54 @@ static int debug_numresults(lua_State *L)
 	return 1;
 }
 
+static int debug_memstats(lua_State *L)
+{
+	lua::gc::memstats stats;
+	bool tracked = lua::gc::getstats(L, stats);
+	lua_createtable(L, 0, 9);
+	lua_pushinteger(L, stats.total);
+	lua_setfield(L, -2, "total");
+	if(tracked)
+	{
+		lua_pushinteger(L, stats.peak);
+		lua_setfield(L, -2, "peak");
+		lua_pushinteger(L, stats.tick);
+		lua_setfield(L, -2, "tick");
+		lua_pushinteger(L, (lua_Integer)stats.allocated);
+		lua_setfield(L, -2, "allocated");
+	}
+
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, stats.table);
+	lua_setfield(L, -2, "table");
+	lua_pushinteger(L, stats.string);
+	lua_setfield(L, -2, "string");
+	lua_pushinteger(L, stats.function);
+	lua_setfield(L, -2, "function");
+	lua_pushinteger(L, stats.userdata);
+	lua_setfield(L, -2, "userdata");
+	lua_pushinteger(L, stats.thread);
+	lua_setfield(L, -2, "thread");
+	lua_pushinteger(L, stats.proto);
+	lua_setfield(L, -2, "proto");
+	lua_setfield(L, -2, "types");
+
+	lua_pushinteger(L, stats.cycles);
+	lua_setfield(L, -2, "cycles");
+
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, stats.propagate_time / 1000000.0);
+	lua_setfield(L, -2, "propagate");
+	lua_pushnumber(L, stats.atomic_time / 1000000.0);
+	lua_setfield(L, -2, "atomic");
+	lua_pushnumber(L, stats.sweep_time / 1000000.0);
+	lua_setfield(L, -2, "sweep");
+	lua_pushnumber(L, stats.finalize_time / 1000000.0);
+	lua_setfield(L, -2, "finalize");
+	lua_setfield(L, -2, "time");
+	return 1;
+}
+
 std::queue<std::weak_ptr<lua_State*>> exit_queue;
 
 static int exit(lua_State *L)
@@ -411,6 +560,17 @@ static int exit(lua_State *L)
 	return 0;
 }
 
+static int fork(lua_State *L)
+{
+	auto NL = lua::clonestate(L);
+	if(!NL)
+	{
+		return 0;
+	}
+	lua_pushlightuserdata(L, NL);
+	return 1;
+}
+
 static int array(lua_State *L)
 {
 	int top = lua_gettop(L);
@@ -492,6 +652,12 @@ static int open_base(lua_State *L)
 	lua_pushcfunction(L, array);
 	lua_setfield(L, -2, "array");
 
+	lua_pushcfunction(L, fork);
+	lua_setfield(L, -2, "fork");
+
+	lua_pushcfunction(L, lua::channel::newchannel);
+	lua_setfield(L, -2, "channel");
+
 	open_package(L);
 	lua_pop(L, 1);
 
@@ -513,6 +679,8 @@ static int open_debug(lua_State *L)
 	luaopen_debug(L);
 	lua_pushcfunction(L, debug_numresults);
 	lua_setfield(L, -2, "numresults");
+	lua_pushcfunction(L, debug_memstats);
+	lua_setfield(L, -2, "memstats");
 	return 1;
 }
 
@@ -593,9 +761,22 @@ static int coroutine_resumehooked(lua_State *L)
 	});
 }
 
+static int coroutine_running(lua_State *L)
+{
+	bool ismain = lua_pushthread(L);
+	if(!ismain)
+	{
+		expose(L);
+	}
+	lua_pushboolean(L, ismain);
+	return 2;
+}
+
 static int open_coroutine(lua_State *L)
 {
 	luaopen_coroutine(L);
+	lua_pushcfunction(L, coroutine_running);
+	lua_setfield(L, -2, "running");
 	lua_getfield(L, -1, "resume");
 	lua_pushcclosure(L, coroutine_resumehooked, 1);
 	lua_setfield(L, -2, "resumehooked");
@@ -618,6 +799,89 @@ static std::vector<std::pair<const char*, lua_CFunction>> libs = {
 	{"remote", lua::remote::loader},
 };
 
+struct state_config
+{
+	int load;
+	int preload;
+	int memlimit;
+	int cpulimit;
+	int ticklimit;
+};
+
+static const char CONFIGKEY = 0;
+
+lua_State *lua::newstate(int load, int preload, int memlimit, int cpulimit, int ticklimit)
+{
+	auto L = luaL_newstate();
+	if(L)
+	{
+		lua_atpanic(L, lua::atpanic);
+		lua::budget::limit(L, cpulimit, ticklimit);
+		long long memlimit_bytes = memlimit * 1024LL;
+		auto stats = lua::gc::schedule(L);
+
+		void *ud;
+		auto oldalloc = lua_getallocf(L, &ud);
+		lua::setallocf(L, [=](void *ptr, size_t osize, size_t nsize)
+		{
+			if(memlimit_bytes >= 0 && (long long)(stats->total + nsize) > memlimit_bytes)
+			{
+				if(ptr == nullptr || nsize > osize)
+				{
+					return static_cast<void*>(nullptr);
+				}
+			}
+			void *ret = oldalloc(ud, ptr, osize, nsize);
+			if(ret || nsize == 0)
+			{
+				stats->alloc(ptr, osize, nsize);
+			}
+			return ret;
+		});
+
+		auto config = reinterpret_cast<state_config*>(lua_newuserdata(L, sizeof(state_config)));
+		*config = {load, preload, memlimit, cpulimit, ticklimit};
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &CONFIGKEY);
+
+		lua::initlibs(L, load, preload);
+	}
+	return L;
+}
+
+static int clone_globals(lua_State *L)
+{
+	lua::clone(reinterpret_cast<lua_State*>(lua_touserdata(L, 1)), L);
+	return 0;
+}
+
+lua_State *lua::clonestate(lua_State *L)
+{
+	state_config config = {0xCD, 0x1C00, -1, -1, -1};
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &CONFIGKEY) == LUA_TUSERDATA)
+	{
+		config = *reinterpret_cast<state_config*>(lua_touserdata(L, -1));
+	}
+	lua_pop(L, 1);
+
+	auto NL = newstate(config.load, config.preload, config.memlimit, config.cpulimit, config.ticklimit);
+	if(NL)
+	{
+		int top = lua_gettop(L);
+		lua_pushcfunction(NL, clone_globals);
+		lua_pushlightuserdata(NL, L);
+		int error = lua_pcall(NL, 1, 0, 0);
+		lua_settop(L, top);
+		if(error != LUA_OK)
+		{
+			lua::report_error(NL, error);
+			lua_close(NL);
+			lua::cleanup(NL);
+			return nullptr;
+		}
+	}
+	return NL;
+}
+
 void lua::initlibs(lua_State *L, int load, int preload)
 {
 	for(size_t i = 0; i < libs.size(); i++)
@@ -744,4 +1008,7 @@ void lua::process_tick()
 			}
 		}
 	}
+
+	lua::gc::tick();
+	lua::budget::tick();
 }
@@ -6,6 +6,8 @@
 
 namespace lua
 {
+	lua_State *newstate(int load, int preload, int memlimit, int cpulimit, int ticklimit);
+	lua_State *clonestate(lua_State *L);
 	void initlibs(lua_State *L, int load, int preload);
 	cell init_bind(lua_State *L, AMX *amx);
 	int bind(AMX *amx, cell *retval, int index);
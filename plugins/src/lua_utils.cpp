@@ -2,8 +2,12 @@
 #include "amx/amxutils.h"
 #include "sdk/amx/amx.h"
 #include "lua/lstate.h"
+#include "lua/lstring.h"
+#include "lua/lgc.h"
+#include "lua/ltm.h"
 
 #include <unordered_map>
+#include <cstring>
 #include <assert.h>
 
 void errortable(lua_State *L, int error)
@@ -68,9 +72,15 @@ void *lua::testudata(lua_State *L, int ud, int mt)
 	return nullptr;
 }
 
+static const char BUFTYPEKEY = 0;
+
 void *lua::tobuffer(lua_State *L, int idx, size_t &length, bool &isconst)
 {
 	idx = lua_absindex(L, idx);
+	if(auto type = getbuffertype(L, idx))
+	{
+		return type->get(L, idx, length, isconst);
+	}
 	if(lua_getmetatable(L, idx))
 	{
 		if(lua_getfield(L, -1, "__buf") != LUA_TNIL)
@@ -91,6 +101,45 @@ void *lua::tobuffer(lua_State *L, int idx, size_t &length, bool &isconst)
 	return nullptr;
 }
 
+void lua::setbuffertype(lua_State *L, int mt, const buffer_type &type)
+{
+	mt = lua_absindex(L, mt);
+	if(lua_rawgetp(L, LUA_REGISTRYINDEX, &BUFTYPEKEY) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 2);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &BUFTYPEKEY);
+		lua::pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_pushvalue(L, -1);
+		lua_setmetatable(L, -2);
+	}
+	lua_pushvalue(L, mt);
+	lua_pushlightuserdata(L, const_cast<buffer_type*>(&type));
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+const lua::buffer_type *lua::getbuffertype(lua_State *L, int idx)
+{
+	const buffer_type *type = nullptr;
+	if(lua_getmetatable(L, idx))
+	{
+		if(lua_rawgetp(L, LUA_REGISTRYINDEX, &BUFTYPEKEY) == LUA_TTABLE)
+		{
+			lua_pushvalue(L, -2);
+			if(lua_rawget(L, -2) == LUA_TLIGHTUSERDATA)
+			{
+				type = reinterpret_cast<const buffer_type*>(lua_touserdata(L, -1));
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 2);
+	}
+	return type;
+}
+
 ptrdiff_t lua::checkoffset(lua_State *L, int idx)
 {
 	if(lua_isinteger(L, idx))
@@ -133,9 +182,64 @@ void lua::pushcfunction(lua_State *L, lua::CFunction &&fn)
 	}, 1);
 }
 
+static bool hasmetatable(lua_State *L, int idx)
+{
+	if(lua_getmetatable(L, idx))
+	{
+		lua_pop(L, 1);
+		return true;
+	}
+	return false;
+}
+
+static bool hasindex(lua_State *L, int idx)
+{
+	auto t = reinterpret_cast<const Table*>(lua_topointer(L, idx));
+	return fasttm(L, t->metatable, TM_INDEX) != nullptr;
+}
+
+// pushes k if it is already interned, without allocating or running the GC
+static bool pushinterned(lua_State *L, const char *k, size_t l)
+{
+	global_State *g = G(L);
+	unsigned int h = luaS_hash(k, l, g->seed);
+	for(TString *ts = g->strt.hash[lmod(h, g->strt.size)]; ts; ts = ts->u.hnext)
+	{
+		if(l == ts->shrlen && std::memcmp(k, getstr(ts), l) == 0)
+		{
+			if(isdead(g, ts))
+			{
+				changewhite(ts);
+			}
+			setsvalue2s(L, L->top, ts);
+			L->top++;
+			return true;
+		}
+	}
+	return false;
+}
+
 int lua::pgetfield(lua_State *L, int idx, const char *k)
 {
 	idx = lua_absindex(L, idx);
+	size_t l = std::strlen(k);
+	if(lua_istable(L, idx) && l <= LUAI_MAXSHORTLEN)
+	{
+		if(!pushinterned(L, k, l))
+		{
+			// a string that was never created cannot be a key
+			if(!hasindex(L, idx))
+			{
+				lua_pushnil(L);
+				return LUA_OK;
+			}
+		}else if(lua_rawget(L, idx) != LUA_TNIL || !hasindex(L, idx))
+		{
+			return LUA_OK;
+		}else{
+			lua_pop(L, 1);
+		}
+	}
 	lua_pushcfunction(L, [](lua_State *L)
 	{
 		auto k = reinterpret_cast<const char*>(lua_touserdata(L, 2));
@@ -260,6 +364,16 @@ int lua::argerrortype(lua_State *L, int arg, const char *expected)
 int lua::pgettable(lua_State *L, int idx)
 {
 	idx = lua_absindex(L, idx);
+	if(lua_istable(L, idx))
+	{
+		lua_pushvalue(L, -1);
+		if(lua_rawget(L, idx) != LUA_TNIL || !hasmetatable(L, idx))
+		{
+			lua_remove(L, -2);
+			return LUA_OK;
+		}
+		lua_pop(L, 1);
+	}
 	lua_pushcfunction(L, [](lua_State *L)
 	{
 		lua_gettable(L, 1);
@@ -287,6 +401,12 @@ int lua::pcompare(lua_State *L, int idx1, int idx2, int op)
 {
 	idx1 = lua_absindex(L, idx1);
 	idx2 = lua_absindex(L, idx2);
+	int t1 = lua_type(L, idx1), t2 = lua_type(L, idx2);
+	if(t1 == t2 ? (t1 == LUA_TNUMBER || t1 == LUA_TSTRING) : op == LUA_OPEQ)
+	{
+		lua_pushboolean(L, lua_compare(L, idx1, idx2, op));
+		return LUA_OK;
+	}
 	lua_pushcfunction(L, [](lua_State *L)
 	{
 		lua_pushboolean(L, lua_compare(L, 1, 2, (int)lua_tointeger(L, 3)));
@@ -300,6 +420,27 @@ int lua::pcompare(lua_State *L, int idx1, int idx2, int op)
 
 int lua::parith(lua_State *L, int op)
 {
+	switch(op)
+	{
+		case LUA_OPUNM:
+			if(lua_type(L, -1) == LUA_TNUMBER)
+			{
+				lua_arith(L, op);
+				return LUA_OK;
+			}
+			break;
+		case LUA_OPADD:
+		case LUA_OPSUB:
+		case LUA_OPMUL:
+		case LUA_OPDIV:
+		case LUA_OPPOW:
+			if(lua_type(L, -1) == LUA_TNUMBER && lua_type(L, -2) == LUA_TNUMBER)
+			{
+				lua_arith(L, op);
+				return LUA_OK;
+			}
+			break;
+	}
 	lua_pushcfunction(L, [](lua_State *L)
 	{
 		lua_arith(L, (int)lua_tointeger(L, 1));
@@ -330,6 +471,11 @@ int lua::pconcat(lua_State *L, int n)
 int lua::plen(lua_State *L, int idx)
 {
 	idx = lua_absindex(L, idx);
+	if(lua_type(L, idx) == LUA_TSTRING || (lua_istable(L, idx) && !hasmetatable(L, idx)))
+	{
+		lua_pushinteger(L, lua_rawlen(L, idx));
+		return LUA_OK;
+	}
 	lua_pushcfunction(L, [](lua_State *L)
 	{
 		lua_len(L, 1);
@@ -119,6 +119,14 @@ namespace lua
 
 	void *tobuffer(lua_State *L, int idx, size_t &length, bool &isconst);
 
+	struct buffer_type
+	{
+		void *(*get)(lua_State *L, int idx, size_t &length, bool &isconst);
+	};
+
+	void setbuffertype(lua_State *L, int mt, const buffer_type &type);
+	const buffer_type *getbuffertype(lua_State *L, int idx);
+
 	ptrdiff_t checkoffset(lua_State *L, int idx);
 
 	void *checklightudata(lua_State *L, int idx);
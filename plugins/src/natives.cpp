@@ -3,60 +3,71 @@
 #include "lua_api.h"
 #include "lua_utils.h"
 #include "lua_adapt.h"
+#include "lua/gc.h"
+#include "lua/timer.h"
+#include "lua/channel.h"
 #include "amx/fileutils.h"
 
 #include <string>
-#include <iomanip>
-#include <bitset>
 #include <cctype>
 #include <cstring>
-#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 
-// native Lua:lua_newstate(lua_lib:load=lua_baselibs, lua_lib:preload=lua_newlibs, memlimit=-1);
+// native Lua:lua_newstate(lua_lib:load=lua_baselibs, lua_lib:preload=lua_newlibs, memlimit=-1, cpulimit=-1, ticklimit=-1);
 static cell AMX_NATIVE_CALL n_lua_newstate(AMX *amx, cell *params)
 {
 	if(!lua::check_params(amx, params, 0)) return 0;
-	auto L = luaL_newstate();
-	if(L)
-	{
-		lua_atpanic(L, lua::atpanic);
-		long long memlimit = optparam(3, -1) * 1024;
+	auto L = lua::newstate(optparam(1, 0xCD), optparam(2, 0x1C00), optparam(3, -1), optparam(4, -1), optparam(5, -1));
+	return reinterpret_cast<cell>(L);
+}
 
-		if(memlimit >= 0)
-		{
-			long long total = lua_gc(L, LUA_GCCOUNT, 0);
-			total = total * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+// native Lua:lua_clonestate(Lua:template);
+static cell AMX_NATIVE_CALL n_lua_clonestate(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 1)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
+	return reinterpret_cast<cell>(lua::clonestate(L));
+}
 
-			void *ud;
-			auto oldalloc = lua_getallocf(L, &ud);
-			lua::setallocf(L, [=](void *ptr, size_t osize, size_t nsize) mutable
-			{
-				if(total + nsize > memlimit)
-				{
-					if(ptr == nullptr || nsize > osize)
-					{
-						return static_cast<void*>(nullptr);
-					}
-				}
-				void *ret = oldalloc(ud, ptr, osize, nsize);
-				if(ret)
-				{
-					if(ptr != nullptr)
-					{
-						total -= osize;
-					}
-					total += nsize;
-				}
-				return ret;
-			});
-		}
+// native lua_memstats(Lua:L, stats[], size=sizeof(stats));
+static cell AMX_NATIVE_CALL n_lua_memstats(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 3)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
+	lua::gc::memstats stats;
+	lua::gc::getstats(L, stats);
+
+	cell values[] = {
+		(cell)stats.total, (cell)stats.peak, (cell)stats.tick,
+		(cell)stats.table, (cell)stats.string, (cell)stats.function, (cell)stats.userdata, (cell)stats.thread, (cell)stats.proto,
+		(cell)stats.cycles,
+		(cell)(stats.propagate_time / 1000), (cell)(stats.atomic_time / 1000), (cell)(stats.sweep_time / 1000), (cell)(stats.finalize_time / 1000)
+	};
+	cell *addr;
+	if(amx_GetAddr(amx, params[2], &addr) != AMX_ERR_NONE) return 0;
+	cell size = std::max(std::min(params[3], (cell)(sizeof(values) / sizeof(cell))), 0);
+	std::copy_n(values, size, addr);
+	return size;
+}
 
-		lua::initlibs(L, optparam(1, 0xCD), optparam(2, 0x1C00));
-	}
-	return reinterpret_cast<cell>(L);
+// native lua_gcbudget(usec=-1);
+static cell AMX_NATIVE_CALL n_lua_gcbudget(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 0)) return 0;
+	return lua::gc::budget(optparam(1, -1));
+}
+
+// native lua_timerbudget(usec=-1);
+static cell AMX_NATIVE_CALL n_lua_timerbudget(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 0)) return 0;
+	return lua::timer::budget(optparam(1, -1));
 }
 
 // native bool:lua_dostring(Lua:L, const str[]);
@@ -120,6 +131,254 @@ static cell AMX_NATIVE_CALL n_lua_call(AMX *amx, cell *params)
 	return 1;
 }
 
+static int getpath(lua_State *L, char *path)
+{
+	lua_pushglobaltable(L);
+	while(true)
+	{
+		char *dot = std::strchr(path, '.');
+		if(dot) *dot = '\0';
+		int error = lua::pgetfield(L, -1, path);
+		lua_remove(L, -2);
+		if(error != LUA_OK || !dot)
+		{
+			return error;
+		}
+		path = dot + 1;
+	}
+}
+
+// native lua_status:lua_callf(Lua:L, const func[], const sig[], {Float,_}:...);
+static cell AMX_NATIVE_CALL n_lua_callf(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 3)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
+	char *name;
+	amx_StrParam(amx, params[2], name);
+	char *sig;
+	amx_StrParam(amx, params[3], sig);
+	if(!name)
+	{
+		logprintf("lua_callf: function name is empty");
+		amx_RaiseError(amx, AMX_ERR_NATIVE);
+		return 0;
+	}
+	if(!sig) sig = const_cast<char*>("");
+
+	cell argc = params[0] / sizeof(cell) - 3;
+	const char *results = std::strchr(sig, ':');
+	int nargs = results ? results - sig : std::strlen(sig);
+	int nres = 0;
+	cell needed = nargs;
+	for(int i = 0; i < nargs; i++)
+	{
+		if(!std::strchr("difbsn", sig[i]))
+		{
+			logprintf("lua_callf: invalid argument specifier '%c'", sig[i]);
+			amx_RaiseError(amx, AMX_ERR_NATIVE);
+			return 0;
+		}
+	}
+	if(results)
+	{
+		for(const char *c = ++results; *c; c++)
+		{
+			if(!std::strchr("difbsn", *c))
+			{
+				logprintf("lua_callf: invalid result specifier '%c'", *c);
+				amx_RaiseError(amx, AMX_ERR_NATIVE);
+				return 0;
+			}
+			needed += *c == 's' ? 2 : 1;
+			nres++;
+		}
+	}
+	if(needed > argc)
+	{
+		logprintf("lua_callf: signature '%s' expects %d arguments, got %d", sig, needed, argc);
+		amx_RaiseError(amx, AMX_ERR_NATIVE);
+		return 0;
+	}
+	if(!lua_checkstack(L, std::max(nargs, nres) + 2))
+	{
+		logprintf("lua_callf: stack overflow");
+		amx_RaiseError(amx, AMX_ERR_MEMORY);
+		return 0;
+	}
+
+	int top = lua_gettop(L);
+	int error = getpath(L, name);
+	if(error != LUA_OK)
+	{
+		return error;
+	}
+
+	std::string str;
+	int argn = 0;
+	for(int i = 0; i < nargs; i++)
+	{
+		cell *argv;
+		amx_GetAddr(amx, params[4 + argn++], &argv);
+		switch(sig[i])
+		{
+			case 'd':
+			case 'i':
+				lua_pushinteger(L, *argv);
+				break;
+			case 'f':
+				lua_pushnumber(L, amx_ctof(*argv));
+				break;
+			case 'b':
+				lua_pushboolean(L, *argv);
+				break;
+			case 's':
+			{
+				int len;
+				amx_StrLen(argv, &len);
+				str.resize(len, '\0');
+				amx_GetString(&str[0], argv, 0, len + 1);
+				lua_pushlstring(L, str.data(), len);
+			}
+			break;
+			case 'n':
+				lua_pushnil(L);
+				break;
+		}
+	}
+
+	error = lua_pcall(L, nargs, nres, 0);
+	if(error != LUA_OK)
+	{
+		return error;
+	}
+
+	for(int i = 0; i < nres; i++)
+	{
+		int idx = top + 1 + i;
+		cell *argv;
+		amx_GetAddr(amx, params[4 + argn++], &argv);
+		switch(results[i])
+		{
+			case 'd':
+			case 'i':
+				*argv = static_cast<cell>(lua_tointeger(L, idx));
+				break;
+			case 'f':
+			{
+				float fval = static_cast<float>(lua_tonumber(L, idx));
+				*argv = amx_ftoc(fval);
+			}
+			break;
+			case 'b':
+				*argv = lua_toboolean(L, idx);
+				break;
+			case 's':
+			{
+				cell *size;
+				amx_GetAddr(amx, params[4 + argn++], &size);
+				auto value = lua_tostring(L, idx);
+				if(*size > 0)
+				{
+					amx_SetString(argv, value ? value : "", 0, false, *size);
+				}
+			}
+			break;
+			case 'n':
+				break;
+		}
+	}
+	lua_settop(L, top);
+	return LUA_OK;
+}
+
+struct funcref
+{
+	lua_State *L;
+	int func;
+	int self;
+};
+
+// native LuaFunc:lua_ref(Lua:L, const path[]);
+static cell AMX_NATIVE_CALL n_lua_ref(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 2)) return 0;
+	auto L = lua::mainthread(reinterpret_cast<lua_State*>(params[1]));
+	char *path;
+	amx_StrParam(amx, params[2], path);
+	if(!path) return 0;
+
+	int top = lua_gettop(L);
+	int error = getpath(L, path);
+	if(error != LUA_OK)
+	{
+		lua::report_error(L, error);
+		lua_settop(L, top);
+		return 0;
+	}
+	if(lua_isnil(L, -1))
+	{
+		lua_settop(L, top);
+		return 0;
+	}
+	int func = luaL_ref(L, LUA_REGISTRYINDEX);
+	auto ref = reinterpret_cast<funcref*>(lua_newuserdata(L, sizeof(funcref)));
+	ref->L = L;
+	ref->func = func;
+	ref->self = luaL_ref(L, LUA_REGISTRYINDEX);
+	return reinterpret_cast<cell>(ref);
+}
+
+// native lua_unref(LuaFunc:f);
+static cell AMX_NATIVE_CALL n_lua_unref(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 1)) return 0;
+	auto ref = reinterpret_cast<funcref*>(params[1]);
+	if(!ref) return 0;
+	if(ref->func == LUA_NOREF) return 0;
+	// the record stays anchored by ref->self, since Pawn may still hold the handle
+	luaL_unref(ref->L, LUA_REGISTRYINDEX, ref->func);
+	ref->func = LUA_NOREF;
+	return 1;
+}
+
+// native lua_invoke(LuaFunc:f, ...);
+static cell AMX_NATIVE_CALL n_lua_invoke(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 1)) return 0;
+	auto ref = reinterpret_cast<funcref*>(params[1]);
+	if(!ref || ref->func == LUA_NOREF) return 0;
+	auto L = ref->L;
+	cell argc = params[0] / sizeof(cell) - 1;
+	if(!lua_checkstack(L, argc + 1))
+	{
+		logprintf("lua_invoke: stack overflow");
+		amx_RaiseError(amx, AMX_ERR_MEMORY);
+		return 0;
+	}
+
+	int top = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ref->func);
+	for(cell i = 0; i < argc; i++)
+	{
+		cell *argv;
+		amx_GetAddr(amx, params[2 + i], &argv);
+		lua_pushinteger(L, *argv);
+	}
+	cell result = 0;
+	int error = lua_pcall(L, argc, 1, 0);
+	if(error != LUA_OK)
+	{
+		lua::report_error(L, error);
+	}else if(lua_isboolean(L, -1))
+	{
+		result = lua_toboolean(L, -1);
+	}else{
+		result = static_cast<cell>(lua_tointeger(L, -1));
+	}
+	lua_settop(L, top);
+	return result;
+}
+
 // native lua_status:lua_load(Lua:L, const reader[], data, bufsize, chunkname[]="");
 static cell AMX_NATIVE_CALL n_lua_load(AMX *amx, cell *params)
 {
@@ -552,189 +811,419 @@ static cell AMX_NATIVE_CALL n_lua_pushstring(AMX *amx, cell *params)
 	return 1;
 }
 
-void add_query(std::string &buf, const cell *arg)
+static cell *getaddr(AMX *amx, cell amx_addr)
 {
-	int len;
-	amx_StrLen(arg, &len);
-
-	char *str = reinterpret_cast<char*>(alloca(len + 1));
-	amx_GetString(str, arg, 0, len + 1);
-
-	buf.reserve(len);
-
-	const char *start = str;
-	while(len--)
+	if(amx_addr >= 0 && (amx_addr < amx->hea || (amx_addr >= amx->stk && amx_addr < amx->stp)))
 	{
-		if(*str == '\'')
-		{
-			buf.append(start, str - start + 1);
-			buf.push_back('\'');
-			start = str + 1;
-		}
-		str++;
+		auto hdr = (AMX_HEADER*)amx->base;
+		auto data = (amx->data != NULL) ? amx->data : amx->base + (int)hdr->dat;
+		return reinterpret_cast<cell*>(data + amx_addr);
 	}
-	buf.append(start, str - start);
+	cell *addr;
+	if(amx_GetAddr(amx, amx_addr, &addr) != AMX_ERR_NONE)
+	{
+		return nullptr;
+	}
+	return addr;
 }
 
-namespace aux
+class amx_chars
 {
-	void push_args(std::ostream &ostream)
+	const cell *str;
+	bool packed;
+	size_t pos = 0;
+
+public:
+	amx_chars(const cell *str) : str(str), packed(str && static_cast<ucell>(*str) > UNPACKEDMAX)
 	{
 
 	}
 
-	template <class Arg, class... Args>
-	void push_args(std::ostream &ostream, Arg &&arg, Args&&... args)
+	char next()
 	{
-		ostream << std::forward<Arg>(arg);
-		push_args(ostream, std::forward<Args>(args)...);
+		if(!str) return '\0';
+		char c;
+		if(packed)
+		{
+			c = static_cast<char>(static_cast<ucell>(str[pos / sizeof(cell)]) >> ((sizeof(cell) - 1 - pos % sizeof(cell)) * 8));
+		}else{
+			c = static_cast<char>(str[pos]);
+		}
+		if(c) pos++;
+		return c;
 	}
+};
 
-	template <class Obj, class... Args>
-	std::string to_string(Obj &&obj, Args&&... args)
+static void add_chars(luaL_Buffer *b, const cell *arg, bool query)
+{
+	amx_chars str(arg);
+	char c;
+	while((c = str.next()))
 	{
-		std::ostringstream ostream;
-		push_args(ostream, std::forward<Args>(args)...);
-		ostream << std::forward<Obj>(obj);
-		return ostream.str();
+		if(query && c == '\'')
+		{
+			luaL_addchar(b, '\'');
+		}
+		luaL_addchar(b, c);
 	}
+}
+
+static void add_unsigned(luaL_Buffer *b, unsigned long long val, unsigned base = 10, int width = 0)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	char buf[64];
+	char *end = buf + sizeof(buf), *p = end;
+	do{
+		*--p = digits[val % base];
+		val /= base;
+	}while(val || end - p < width);
+	luaL_addlstring(b, p, end - p);
+}
 
-	template <class NumType>
-	NumType parse_num(const char *str, size_t &pos)
+static void add_fixed(luaL_Buffer *b, double val, int precision)
+{
+	static const unsigned long long pow10[] = {1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL};
+	if(precision < 0 || precision > 9 || !std::isfinite(val) || std::fabs(val) * pow10[precision] >= 9e18)
 	{
-		bool neg = str[pos] == '-';
-		if(neg) pos++;
-		NumType val = 0;
-		char c;
-		while(std::isdigit(c = str[pos++]))
+		char *buf = luaL_prepbuffsize(b, LUAL_BUFFERSIZE);
+		int len = std::snprintf(buf, LUAL_BUFFERSIZE, "%.*f", precision < 0 ? 6 : precision, val);
+		if(len >= LUAL_BUFFERSIZE)
 		{
-			val = (val * 10) + (c - '0');
+			buf = luaL_prepbuffsize(b, len + 1);
+			std::snprintf(buf, len + 1, "%.*f", precision, val);
 		}
-		return neg ? -val : val;
+		luaL_addsize(b, len);
+		return;
+	}
+	if(std::signbit(val))
+	{
+		luaL_addchar(b, '-');
+		val = -val;
+	}
+	double whole = std::floor(val * pow10[precision]);
+	double rest = val * pow10[precision] - whole;
+	if(rest > 0.5 || (rest == 0.5 && std::fmod(whole, 2.0) != 0.0))
+	{
+		whole += 1.0;
+	}
+	auto scaled = static_cast<unsigned long long>(whole);
+	add_unsigned(b, scaled / pow10[precision]);
+	if(precision > 0)
+	{
+		luaL_addchar(b, '.');
+		add_unsigned(b, scaled % pow10[precision], 10, precision);
 	}
 }
 
-void add_format(std::string &buf, const char *begin, const char *end, cell *arg)
+static void add_format(lua_State *L, luaL_Buffer *b, const char *spec, char conv, cell *arg, int top)
 {
-	ptrdiff_t flen = end - begin;
-	switch(*end)
+	switch(conv)
 	{
 		case 's':
-		{
-			int len;
-			amx_StrLen(arg, &len);
-			size_t begin = buf.size();
-			buf.resize(begin + len, '\0');
-			amx_GetString(&buf[begin], arg, 0, len + 1);
-		}
-		break;
 		case 'q':
 		{
-			add_query(buf, arg);
+			add_chars(b, arg, conv == 'q');
 		}
 		break;
 		case 'd':
 		case 'i':
 		{
-			buf.append(std::to_string(*arg));
+			if(*arg < 0)
+			{
+				luaL_addchar(b, '-');
+			}
+			add_unsigned(b, *arg < 0 ? -static_cast<long long>(*arg) : *arg);
 		}
 		break;
 		case 'f':
 		{
-			if(*begin == '.')
+			int precision = 6;
+			if(*spec == '.')
 			{
-				size_t pos = 0;
-				auto precision = aux::parse_num<std::streamsize>(begin + 1, pos);
-				buf.append(aux::to_string(amx_ctof(*arg), std::setprecision(precision), std::fixed));
-			}else{
-				buf.append(std::to_string(amx_ctof(*arg)));
+				precision = std::atoi(spec + 1);
 			}
+			add_fixed(b, amx_ctof(*arg), precision);
 		}
 		break;
 		case 'c':
 		{
-			buf.append(1, static_cast<char>(*arg));
+			luaL_addchar(b, static_cast<char>(*arg));
 		}
 		break;
 		case 'h':
 		case 'x':
 		{
-			buf.append(aux::to_string(*arg, std::hex, std::uppercase));
+			add_unsigned(b, static_cast<ucell>(*arg), 16);
 		}
 		break;
 		case 'o':
 		{
-			buf.append(aux::to_string(*arg, std::oct));
+			add_unsigned(b, static_cast<ucell>(*arg), 8);
 		}
 		break;
 		case 'b':
 		{
-			std::bitset<8> bits(*arg);
-			buf.append(bits.to_string());
+			add_unsigned(b, static_cast<ucell>(*arg) & 0xFF, 2, 8);
 		}
 		break;
 		case 'u':
 		{
-			buf.append(std::to_string(static_cast<ucell>(*arg)));
+			add_unsigned(b, static_cast<ucell>(*arg));
 		}
 		break;
+		case 'v':
+		{
+			int idx = *arg < 0 && *arg > LUA_REGISTRYINDEX ? top + *arg + 1 : *arg;
+			luaL_tolstring(L, idx, nullptr);
+			luaL_addvalue(b);
+		}
+		break;
+	}
+}
+
+static void format(AMX *amx, lua_State *L, luaL_Buffer *b, cell fmt, cell *args, cell argc)
+{
+	int top = lua_gettop(L);
+	luaL_buffinit(L, b);
+
+	amx_chars str(getaddr(amx, fmt));
+	cell argn = 0;
+	char c;
+	while((c = str.next()))
+	{
+		if(c != '%')
+		{
+			luaL_addchar(b, c);
+			continue;
+		}
+		char spec[16];
+		size_t len = 0;
+		while((c = str.next()) && !std::isalpha(c) && c != '%')
+		{
+			if(len < sizeof(spec) - 1) spec[len++] = c;
+		}
+		spec[len] = '\0';
+		if(!c) break;
+		if(c == '%')
+		{
+			luaL_addchar(b, '%');
+		}else if(argn < argc)
+		{
+			cell *arg = getaddr(amx, args[argn++]);
+			if(arg)
+			{
+				add_format(L, b, spec, c, arg, top);
+			}
+		}
 	}
 }
 
+// native lua_pushfstring(Lua:L, const fmt[], {Float,_}:...);
 static cell AMX_NATIVE_CALL n_lua_pushfstring(AMX *amx, cell *params)
 {
 	if(!lua::check_params(amx, params, 2)) return 0;
 	auto L = reinterpret_cast<lua_State*>(params[1]);
 
-	cell *addr;
-	amx_GetAddr(amx, params[2], &addr);
-	int len;
-	amx_StrLen(addr, &len);
-	char *fmt = reinterpret_cast<char*>(alloca(len + 1));
-	amx_GetString(fmt, addr, 0, len + 1);
+	luaL_Buffer b;
+	format(amx, L, &b, params[2], params + 3, params[0] / sizeof(cell) - 2);
+	luaL_pushresult(&b);
+	return 1;
+}
 
-	cell argc = params[0] / sizeof(cell) - 2;
+// native lua_format(Lua:L, dest[], size, const fmt[], {Float,_}:...);
+static cell AMX_NATIVE_CALL n_lua_format(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 4)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
 
-	std::string buf;
-	buf.reserve(len + 8 * argc);
+	luaL_Buffer b;
+	format(amx, L, &b, params[4], params + 5, params[0] / sizeof(cell) - 4);
+	luaL_pushresult(&b);
 
-	int argn = 0;
+	size_t len;
+	auto str = lua_tolstring(L, -1, &len);
+	cell *addr = getaddr(amx, params[2]);
+	if(addr && params[3] > 0)
+	{
+		amx_SetString(addr, str, false, false, params[3]);
+	}
+	lua_pop(L, 1);
+	return len;
+}
+
+enum array_type
+{
+	array_integer,
+	array_float,
+	array_boolean,
+};
+
+// native lua_toarray(Lua:L, idx, {_,Float,bool}:dest[], size=sizeof(dest), lua_array_type:type=lua_array_integer);
+static cell AMX_NATIVE_CALL n_lua_toarray(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 4)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
+	int idx = lua_absindex(L, params[2]);
+	if(lua_type(L, idx) != LUA_TTABLE) return 0;
+	cell *addr = getaddr(amx, params[3]);
+	if(!addr) return 0;
 
-	char *c = fmt;
-	while(len--)
+	auto type = static_cast<array_type>(optparam(5, array_integer));
+	cell size = std::min(static_cast<cell>(lua_rawlen(L, idx)), params[4]);
+	for(cell i = 0; i < size; i++)
 	{
-		if(*c == '%' && len > 0)
+		lua_rawgeti(L, idx, i + 1);
+		switch(type)
 		{
-			buf.append(fmt, c - fmt);
-
-			const char *start = ++c;
-			if(*c == '%')
+			case array_integer:
 			{
-				buf.push_back('%');
-				fmt = c + 1;
-				len--;
-			}else{
-				while(len-- && !std::isalpha(*c)) c++;
-				if(len < 0) break;
-				if(argn >= argc)
-				{
-					//error
-				}else{
-					cell *argv;
-					amx_GetAddr(amx, params[3 + argn++], &argv);
-					add_format(buf, start, c, argv);
-				}
-				fmt = c + 1;
+				int isnum;
+				lua_Integer ival = lua_tointegerx(L, -1, &isnum);
+				addr[i] = isnum ? static_cast<cell>(ival) : static_cast<cell>(lua_tonumber(L, -1));
 			}
+			break;
+			case array_float:
+			{
+				float fval = static_cast<float>(lua_tonumber(L, -1));
+				addr[i] = amx_ftoc(fval);
+			}
+			break;
+			case array_boolean:
+			{
+				addr[i] = lua_toboolean(L, -1);
+			}
+			break;
 		}
-		c++;
+		lua_pop(L, 1);
 	}
-	buf.append(fmt, c - fmt);
+	return size;
+}
 
-	lua_pushlstring(L, &buf[0], buf.size());
+// native lua_fromarray(Lua:L, const {_,Float,bool}:src[], size=sizeof(src), lua_array_type:type=lua_array_integer);
+static cell AMX_NATIVE_CALL n_lua_fromarray(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 3)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
+	cell *addr = getaddr(amx, params[2]);
+	if(!addr) return 0;
+
+	auto type = static_cast<array_type>(optparam(4, array_integer));
+	cell size = std::max(params[3], 0);
+	lua_createtable(L, size, 0);
+	for(cell i = 0; i < size; i++)
+	{
+		switch(type)
+		{
+			case array_integer:
+				lua_pushinteger(L, addr[i]);
+				break;
+			case array_float:
+				lua_pushnumber(L, amx_ctof(addr[i]));
+				break;
+			case array_boolean:
+				lua_pushboolean(L, addr[i]);
+				break;
+			default:
+				lua_pushnil(L);
+				break;
+		}
+		lua_rawseti(L, -2, i + 1);
+	}
 	return 1;
 }
 
+// native lua_tostrings(Lua:L, idx, dest[][], size=sizeof(dest), len=sizeof(dest[]), bool:pack=false);
+static cell AMX_NATIVE_CALL n_lua_tostrings(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 5)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
+	int idx = lua_absindex(L, params[2]);
+	if(lua_type(L, idx) != LUA_TTABLE) return 0;
+	cell *addr = getaddr(amx, params[3]);
+	if(!addr || params[5] <= 0) return 0;
+
+	bool pack = optparam(6, 0);
+	cell size = std::min(static_cast<cell>(lua_rawlen(L, idx)), params[4]);
+	for(cell i = 0; i < size; i++)
+	{
+		auto row = reinterpret_cast<cell*>(reinterpret_cast<unsigned char*>(addr + i) + addr[i]);
+		lua_rawgeti(L, idx, i + 1);
+		auto str = lua_tostring(L, -1);
+		amx_SetString(row, str ? str : "", pack, false, params[5]);
+		lua_pop(L, 1);
+	}
+	return size;
+}
+
+// native lua_fromstrings(Lua:L, const src[][], size=sizeof(src));
+static cell AMX_NATIVE_CALL n_lua_fromstrings(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 3)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
+	cell *addr = getaddr(amx, params[2]);
+	if(!addr) return 0;
+
+	cell size = std::max(params[3], 0);
+	lua_createtable(L, size, 0);
+	for(cell i = 0; i < size; i++)
+	{
+		auto row = reinterpret_cast<cell*>(reinterpret_cast<unsigned char*>(addr + i) + addr[i]);
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+		add_chars(&b, row, false);
+		luaL_pushresult(&b);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+// native Channel:lua_newchannel(Lua:L, capacity);
+static cell AMX_NATIVE_CALL n_lua_newchannel(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 2)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
+	if(params[2] < 2 || params[2] > lua::channel::max_capacity) return 0;
+	return reinterpret_cast<cell>(lua::channel::create(L, params[2]));
+}
+
+// native Channel:lua_tochannel(Lua:L, idx);
+static cell AMX_NATIVE_CALL n_lua_tochannel(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 2)) return 0;
+	auto L = reinterpret_cast<lua_State*>(params[1]);
+	return reinterpret_cast<cell>(lua::channel::tochannel(L, params[2]));
+}
+
+// native bool:lua_chanwrite(Channel:ch, const data[], size=sizeof(data));
+static cell AMX_NATIVE_CALL n_lua_chanwrite(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 3)) return 0;
+	auto ch = reinterpret_cast<lua::channel::ring*>(params[1]);
+	cell *addr = getaddr(amx, params[2]);
+	if(!ch || !addr) return 0;
+	return lua::channel::write(ch, addr, params[3]);
+}
+
+// native lua_chanread(Channel:ch, dest[], size=sizeof(dest));
+static cell AMX_NATIVE_CALL n_lua_chanread(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 3)) return -1;
+	auto ch = reinterpret_cast<lua::channel::ring*>(params[1]);
+	cell *addr = getaddr(amx, params[2]);
+	if(!ch || !addr) return -1;
+	return lua::channel::read(ch, addr, params[3]);
+}
+
+// native lua_chandrain(Channel:ch, dest[], size=sizeof(dest));
+static cell AMX_NATIVE_CALL n_lua_chandrain(AMX *amx, cell *params)
+{
+	if(!lua::check_params(amx, params, 3)) return 0;
+	auto ch = reinterpret_cast<lua::channel::ring*>(params[1]);
+	cell *addr = getaddr(amx, params[2]);
+	if(!ch || !addr) return 0;
+	return lua::channel::drain(ch, addr, params[3]);
+}
+
 struct LoadF
 {
 	int n;
@@ -1037,6 +1526,10 @@ static cell AMX_NATIVE_CALL error_wrapper(AMX *amx, cell *params)
 #define AMX_DECLARE_NATIVE(Name) {#Name, error_wrapper<n_##Name>}
 #define AMX_DECLARE_LUA_NATIVE(Name) {#Name, error_wrapper<lua::adapt<decltype(&Name), &Name>::native>}
 
+// natives that only read or push stack slots cannot raise a Lua error and skip the exception frame
+#define AMX_DECLARE_NOTHROW_NATIVE(Name) {#Name, n_##Name}
+#define AMX_DECLARE_NOTHROW_LUA_NATIVE(Name) {#Name, lua::adapt<decltype(&Name), &Name>::native}
+
 static AMX_NATIVE_INFO native_list[] =
 {
 	AMX_DECLARE_NATIVE(lua_bind),
@@ -1044,15 +1537,23 @@ static AMX_NATIVE_INFO native_list[] =
 	AMX_DECLARE_NATIVE(lua_stackdump),
 
 	AMX_DECLARE_NATIVE(lua_newstate),
+	AMX_DECLARE_NATIVE(lua_clonestate),
 	AMX_DECLARE_NATIVE(lua_close),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_gcbudget),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_timerbudget),
+	AMX_DECLARE_NATIVE(lua_memstats),
 	AMX_DECLARE_NATIVE(lua_load),
 	AMX_DECLARE_NATIVE(lua_pcall),
 	AMX_DECLARE_NATIVE(lua_call),
+	AMX_DECLARE_NATIVE(lua_callf),
+	AMX_DECLARE_NATIVE(lua_ref),
+	AMX_DECLARE_NATIVE(lua_unref),
+	AMX_DECLARE_NATIVE(lua_invoke),
 	AMX_DECLARE_NATIVE(lua_dostring),
 	AMX_DECLARE_NATIVE(lua_tostring),
-	AMX_DECLARE_NATIVE(lua_tonumber),
-	AMX_DECLARE_NATIVE(lua_tointeger),
-	AMX_DECLARE_NATIVE(lua_pop),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_tonumber),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_tointeger),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_pop),
 	AMX_DECLARE_NATIVE(lua_pushpfunction),
 	AMX_DECLARE_NATIVE(lua_settable),
 	AMX_DECLARE_NATIVE(lua_setfield),
@@ -1063,59 +1564,69 @@ static AMX_NATIVE_INFO native_list[] =
 	AMX_DECLARE_NATIVE(lua_len),
 	AMX_DECLARE_NATIVE(lua_pushstring),
 	AMX_DECLARE_NATIVE(lua_pushfstring),
+	AMX_DECLARE_NATIVE(lua_format),
+	AMX_DECLARE_NATIVE(lua_toarray),
+	AMX_DECLARE_NATIVE(lua_fromarray),
+	AMX_DECLARE_NATIVE(lua_tostrings),
+	AMX_DECLARE_NATIVE(lua_fromstrings),
+	AMX_DECLARE_NATIVE(lua_newchannel),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_tochannel),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_chanwrite),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_chanread),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_chandrain),
 	AMX_DECLARE_NATIVE(lua_loadstream),
 	AMX_DECLARE_NATIVE(lua_loader),
 	AMX_DECLARE_NATIVE(lua_write),
 	AMX_DECLARE_NATIVE(lua_pushuserdata),
-	AMX_DECLARE_NATIVE(lua_getuserdata),
-	AMX_DECLARE_NATIVE(lua_setuserdata),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_getuserdata),
+	AMX_DECLARE_NOTHROW_NATIVE(lua_setuserdata),
 
-	AMX_DECLARE_LUA_NATIVE(lua_absindex),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_absindex),
 	AMX_DECLARE_LUA_NATIVE(lua_arith),
-	AMX_DECLARE_LUA_NATIVE(lua_checkstack),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_checkstack),
 	AMX_DECLARE_LUA_NATIVE(lua_compare),
-	AMX_DECLARE_LUA_NATIVE(lua_copy),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_copy),
 	AMX_DECLARE_LUA_NATIVE(lua_createtable),
 	AMX_DECLARE_LUA_NATIVE(lua_gc),
 	AMX_DECLARE_LUA_NATIVE(lua_getmetatable),
-	AMX_DECLARE_LUA_NATIVE(lua_gettop),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_gettop),
 	AMX_DECLARE_LUA_NATIVE(lua_getuservalue),
-	AMX_DECLARE_LUA_NATIVE(lua_iscfunction),
-	AMX_DECLARE_LUA_NATIVE(lua_isinteger),
-	AMX_DECLARE_LUA_NATIVE(lua_isnumber),
-	AMX_DECLARE_LUA_NATIVE(lua_isstring),
-	AMX_DECLARE_LUA_NATIVE(lua_isuserdata),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_iscfunction),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_isinteger),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_isnumber),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_isstring),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_isuserdata),
 	AMX_DECLARE_LUA_NATIVE(lua_newthread),
 	AMX_DECLARE_LUA_NATIVE(lua_newuserdata),
 	AMX_DECLARE_LUA_NATIVE(lua_next),
-	AMX_DECLARE_LUA_NATIVE(lua_pushboolean),
-	AMX_DECLARE_LUA_NATIVE(lua_pushinteger),
-	AMX_DECLARE_LUA_NATIVE(lua_pushlightuserdata),
-	AMX_DECLARE_LUA_NATIVE(lua_pushnil),
-	AMX_DECLARE_LUA_NATIVE(lua_pushnumber),
-	AMX_DECLARE_LUA_NATIVE(lua_pushthread),
-	AMX_DECLARE_LUA_NATIVE(lua_pushvalue),
-	AMX_DECLARE_LUA_NATIVE(lua_rawequal),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_pushboolean),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_pushinteger),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_pushlightuserdata),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_pushnil),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_pushnumber),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_pushthread),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_pushvalue),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_rawequal),
 	AMX_DECLARE_LUA_NATIVE(lua_rawget),
 	AMX_DECLARE_LUA_NATIVE(lua_rawgeti),
 	AMX_DECLARE_LUA_NATIVE(lua_rawgetp),
-	AMX_DECLARE_LUA_NATIVE(lua_rawlen),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_rawlen),
 	AMX_DECLARE_LUA_NATIVE(lua_rawset),
 	AMX_DECLARE_LUA_NATIVE(lua_rawseti),
 	AMX_DECLARE_LUA_NATIVE(lua_rawsetp),
 	AMX_DECLARE_LUA_NATIVE(lua_resume),
-	AMX_DECLARE_LUA_NATIVE(lua_rotate),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_rotate),
 	AMX_DECLARE_LUA_NATIVE(lua_setmetatable),
-	AMX_DECLARE_LUA_NATIVE(lua_settop),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_settop),
 	AMX_DECLARE_LUA_NATIVE(lua_setuservalue),
-	AMX_DECLARE_LUA_NATIVE(lua_status),
-	AMX_DECLARE_LUA_NATIVE(lua_toboolean),
-	AMX_DECLARE_LUA_NATIVE(lua_topointer),
-	AMX_DECLARE_LUA_NATIVE(lua_tothread),
-	AMX_DECLARE_LUA_NATIVE(lua_touserdata),
-	AMX_DECLARE_LUA_NATIVE(lua_type),
-	AMX_DECLARE_LUA_NATIVE(lua_version),
-	AMX_DECLARE_LUA_NATIVE(lua_xmove),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_status),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_toboolean),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_topointer),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_tothread),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_touserdata),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_type),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_version),
+	AMX_DECLARE_NOTHROW_LUA_NATIVE(lua_xmove),
 };
 
 int RegisterNatives(AMX *amx)